@@ -45,6 +45,7 @@ rm -rf $RPM_BUILD_ROOT
 %files
 %defattr(-,root,root,-)
 %{_libdir}/lcmaps/lcmaps_anonymous_accounts.mod
+%{_sbindir}/lcmaps-anon-pool
 %dir /var/lock/%{name}
 
 %changelog
@@ -0,0 +1,498 @@
+/*
+ * Microbenchmarks for the building blocks of the ancestry hash.
+ *
+ * Each primitive in ancestry_hash.cxx is timed in isolation against a
+ * corpus directory laid out like /proc (one <pid>/status and <pid>/stat
+ * per process).  Corpora are either recorded from the live /proc or
+ * synthesized with a given number of processes, so runs are repeatable
+ * across builds and machines.
+ *
+ * For every (primitive, corpus) pair one JSON object is printed per line:
+ * nanoseconds, heap allocations and system calls per operation.  System
+ * calls are counted with the raw_syscalls:sys_enter tracepoint; if tracefs
+ * is not mounted or perf events are not permitted, the count is null.
+ *
+ * Given a previous run's output with --baseline, the benchmark exits with
+ * status 1 if any primitive got slower than the tolerance allows or now
+ * performs more allocations or system calls per operation.
+ *
+ * Usage:
+ *   ancestry_bench --record DIR
+ *   ancestry_bench --synthesize NPROCS DIR
+ *   ancestry_bench [--min-time MS] [--baseline FILE] [--tolerance PCT] CORPUS...
+ */
+
+// The primitives are file-static, so the benchmark is compiled together
+// with them rather than linked against the plugin.
+#include "ancestry_hash.cxx"
+#include "tool_log.h"
+
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#define BENCH_MIN_TIME_MS 200
+#define BENCH_TOLERANCE_PCT 10.0
+
+/*
+ * Allocation counting: every heap allocation made by the process, libc's
+ * own (opendir, fopen) included, goes through these.
+ */
+extern "C" {
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void __libc_free(void *);
+}
+
+static unsigned long long g_allocs = 0;
+
+extern "C" void *malloc(size_t size) throw() {
+    g_allocs++;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size) throw() {
+    g_allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) throw() {
+    g_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void *ptr) throw() {
+    __libc_free(ptr);
+}
+
+/*
+ * System call counting.
+ */
+static const char * tracepoint_ids[] = {
+    "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+    "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    NULL
+};
+
+static int open_syscall_counter() {
+    unsigned long long id = 0;
+    int found = 0;
+    for (const char **path = tracepoint_ids; *path && !found; path++) {
+        FILE *fp = fopen(*path, "r");
+        if (!fp) continue;
+        found = (fscanf(fp, "%llu", &id) == 1);
+        fclose(fp);
+    }
+    if (!found) return -1;
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.size = sizeof(attr);
+    attr.config = id;
+    attr.sample_period = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static int g_syscall_fd = -1;
+
+static long long read_syscall_counter() {
+    unsigned long long value;
+    if (g_syscall_fd == -1) return -1;
+    if (read(g_syscall_fd, &value, sizeof(value)) != sizeof(value)) return -1;
+    return value;
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Corpus handling.
+ */
+static int copy_file(const std::string &from, const std::string &to) {
+    char buffer[buf_size];
+    int in = open(from.c_str(), O_RDONLY);
+    if (in == -1) return -1;
+    // /proc files report a size of 0; a single read returns the content.
+    ssize_t len = read(in, buffer, sizeof(buffer));
+    close(in);
+    if (len < 0) return -1;
+    int out = open(to.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (out == -1) return -1;
+    int rc = (write(out, buffer, len) == len) ? 0 : -1;
+    close(out);
+    return rc;
+}
+
+static int record_corpus(const char *dir) {
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Unable to create %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    DIR *dirp = opendir(PROC);
+    if (!dirp) {
+        fprintf(stderr, "Unable to open %s: %s\n", PROC, strerror(errno));
+        return 1;
+    }
+    struct dirent64 *dp;
+    unsigned recorded = 0;
+    while ((dp = readdir64(dirp)) != NULL) {
+        int pid;
+        if (sscanf(dp->d_name, "%d", &pid) != 1) continue;
+        std::string src = std::string(PROC) + "/" + dp->d_name;
+        std::string dst = std::string(dir) + "/" + dp->d_name;
+        if (mkdir(dst.c_str(), 0755) == -1 && errno != EEXIST) continue;
+        // Processes exit while we walk; drop whatever we could not copy.
+        if (copy_file(src + "/status", dst + "/status") ||
+                copy_file(src + "/stat", dst + "/stat")) {
+            unlink((dst + "/status").c_str());
+            rmdir(dst.c_str());
+            continue;
+        }
+        recorded++;
+    }
+    closedir(dirp);
+    fprintf(stderr, "Recorded %u processes into %s.\n", recorded, dir);
+    return 0;
+}
+
+static int write_process(const std::string &dir, pid_t pid, pid_t ppid, int uid, const char *comm, unsigned long long starttime) {
+    std::string pdir = dir + "/" + std::to_string(pid);
+    if (mkdir(pdir.c_str(), 0755) == -1 && errno != EEXIST) return -1;
+
+    FILE *fp = fopen((pdir + "/status").c_str(), "w");
+    if (!fp) return -1;
+    fprintf(fp, "Name:\t%s\nUmask:\t0022\nState:\tS (sleeping)\nTgid:\t%d\nNgid:\t0\n"
+        "Pid:\t%d\nPPid:\t%d\nTracerPid:\t0\nUid:\t%d\t%d\t%d\t%d\nGid:\t%d\t%d\t%d\t%d\n"
+        "FDSize:\t64\nGroups:\t%d\nNStgid:\t%d\nNSpid:\t%d\nNSpgid:\t%d\nNSsid:\t%d\n"
+        "VmPeak:\t  228248 kB\nVmSize:\t  228248 kB\nVmLck:\t       0 kB\nVmPin:\t       0 kB\n"
+        "VmHWM:\t   11800 kB\nVmRSS:\t   11800 kB\nRssAnon:\t    2904 kB\nRssFile:\t    8896 kB\n"
+        "RssShmem:\t       0 kB\nVmData:\t   19012 kB\nVmStk:\t     132 kB\nVmExe:\t     884 kB\n"
+        "VmLib:\t   10100 kB\nVmPTE:\t      92 kB\nVmSwap:\t       0 kB\nThreads:\t1\n"
+        "SigQ:\t0/63448\nSigPnd:\t0000000000000000\nShdPnd:\t0000000000000000\n"
+        "SigBlk:\t0000000000000000\nSigIgn:\t0000000000001000\nSigCgt:\t00000001800004ec\n"
+        "CapInh:\t0000000000000000\nCapPrm:\t0000000000000000\nCapEff:\t0000000000000000\n"
+        "CapBnd:\t000001ffffffffff\nCapAmb:\t0000000000000000\nNoNewPrivs:\t0\nSeccomp:\t0\n"
+        "Cpus_allowed:\tff\nCpus_allowed_list:\t0-7\nMems_allowed:\t1\nMems_allowed_list:\t0\n"
+        "voluntary_ctxt_switches:\t150\nnonvoluntary_ctxt_switches:\t3\n",
+        comm, pid, pid, ppid, uid, uid, uid, uid, uid, uid, uid, uid, uid, pid, pid, pid, pid);
+    fclose(fp);
+
+    fp = fopen((pdir + "/stat").c_str(), "w");
+    if (!fp) return -1;
+    fprintf(fp, "%d (%s) S %d %d %d 0 -1 4194560 1069 0 0 0 3 1 0 0 20 0 1 0 %llu "
+        "233725952 2950 18446744073709551615 1 1 0 0 0 0 0 4096 17642 0 0 0 17 3 0 0 0 0 0\n",
+        pid, comm, ppid, pid, pid, starttime);
+    fclose(fp);
+    return 0;
+}
+
+// Lay out a batch node: a root-owned batch daemon, and one starter per job
+// running a pilot (UID changes here) with a few payload processes below it.
+#define PROCS_PER_JOB 8
+static int synthesize_corpus(int nprocs, const char *dir) {
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Unable to create %s: %s\n", dir, strerror(errno));
+        return 1;
+    }
+    std::string base(dir);
+    pid_t daemon = 100, next = 1000;
+    unsigned long long starttime = 4200;
+    if (write_process(base, daemon, 1, 0, "condor_startd", starttime)) goto failed;
+    for (int job = 0; next - 1000 < nprocs - 1; job++) {
+        pid_t starter = next++, pilot = next++;
+        int pilot_uid = 5000 + (job % 100);
+        starttime += 97;
+        if (write_process(base, starter, daemon, 0, "condor_starter", starttime)) goto failed;
+        if (write_process(base, pilot, starter, pilot_uid, "pilot", starttime + 3)) goto failed;
+        for (int child = 2; child < PROCS_PER_JOB && next - 1000 < nprocs - 1; child++) {
+            if (write_process(base, next++, pilot, pilot_uid, "payload", starttime + child)) goto failed;
+        }
+    }
+    fprintf(stderr, "Synthesized %d processes into %s.\n", nprocs, dir);
+    return 0;
+
+failed:
+    fprintf(stderr, "Unable to write synthetic process into %s: %s\n", dir, strerror(errno));
+    return 1;
+}
+
+static std::vector<pid_t> list_corpus(const char *dir) {
+    std::vector<pid_t> pids;
+    DIR *dirp = opendir(dir);
+    if (!dirp) return pids;
+    struct dirent64 *dp;
+    while ((dp = readdir64(dirp)) != NULL) {
+        int pid;
+        if (sscanf(dp->d_name, "%d", &pid) == 1 && pid > 1) pids.push_back(pid);
+    }
+    closedir(dirp);
+    std::sort(pids.begin(), pids.end());
+    return pids;
+}
+
+/*
+ * Measurement.
+ */
+struct Result {
+    std::string benchmark;
+    std::string corpus;
+    size_t processes;
+    unsigned long iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    double syscalls_per_op; // negative if not counted
+};
+
+static double g_min_time_ns = BENCH_MIN_TIME_MS * 1e6;
+
+// Run op() in batches of growing size until one batch takes at least the
+// minimum time; report that batch.
+template <typename Op>
+static Result measure(const char *name, const char *corpus, size_t processes, Op op) {
+    Result result;
+    result.benchmark = name;
+    result.corpus = corpus;
+    result.processes = processes;
+    for (unsigned long iterations = 1; ; iterations *= 2) {
+        unsigned long long allocs = g_allocs;
+        long long syscalls = read_syscall_counter();
+        double start = now_ns();
+        for (unsigned long idx = 0; idx < iterations; idx++) {
+            op();
+        }
+        double elapsed = now_ns() - start;
+        long long syscalls_end = read_syscall_counter();
+        allocs = g_allocs - allocs;
+        if (elapsed < g_min_time_ns && iterations < (1UL << 30)) continue;
+
+        result.iterations = iterations;
+        result.ns_per_op = elapsed / iterations;
+        result.allocs_per_op = (double)allocs / iterations;
+        // The closing read of the counter is itself counted.
+        result.syscalls_per_op = (syscalls < 0 || syscalls_end < 0) ? -1 :
+            (double)(syscalls_end - syscalls - 1) / iterations;
+        return result;
+    }
+}
+
+static void print_result(const Result &result) {
+    printf("{\"benchmark\":\"%s\",\"corpus\":\"%s\",\"processes\":%zu,\"iterations\":%lu,"
+        "\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,\"syscalls_per_op\":",
+        result.benchmark.c_str(), result.corpus.c_str(), result.processes, result.iterations,
+        result.ns_per_op, result.allocs_per_op);
+    if (result.syscalls_per_op < 0) {
+        printf("null}\n");
+    } else {
+        printf("%.2f}\n", result.syscalls_per_op);
+    }
+    fflush(stdout);
+}
+
+static int run_corpus(const char *corpus, std::vector<Result> &results) {
+    std::vector<pid_t> pids = list_corpus(corpus);
+    if (pids.empty()) {
+        fprintf(stderr, "Corpus %s contains no processes.\n", corpus);
+        return 1;
+    }
+    proc_root = corpus;
+    delete gAH;
+    gAH = new AncestryHash;
+    gAH->mineProc();
+
+    // Benchmark against the first process whose ancestry contains a UID
+    // transition, as a glexec invocation would have.
+    pid_t target = -1;
+    for (std::vector<pid_t>::const_iterator it = pids.begin(); it != pids.end() && target == -1; it++) {
+        if (gAH->getIdentity(*it).pid) {
+            target = *it;
+        }
+    }
+    if (target == -1) {
+        fprintf(stderr, "Corpus %s has no process with a UID transition in its ancestry.\n", corpus);
+        return 1;
+    }
+    pid_t ppid;
+    if (gAH->getParentIDs(target, &ppid, NULL, NULL)) {
+        fprintf(stderr, "Unable to find parent of %d in corpus %s.\n", target, corpus);
+        return 1;
+    }
+
+    std::string status_path = std::string(corpus) + "/" + std::to_string(target) + "/status";
+    int status_fd = open(status_path.c_str(), O_RDONLY);
+    if (status_fd == -1) {
+        fprintf(stderr, "Unable to open %s: %s\n", status_path.c_str(), strerror(errno));
+        return 1;
+    }
+    char status[buf_size]; status[buf_size-1] = '\0';
+    ssize_t len = read(status_fd, status, buf_size-1);
+    const char *uid_line = (len > 0) ? (status[len] = '\0', strstr(status, "\nUid:")) : NULL;
+    if (!uid_line) {
+        fprintf(stderr, "No Uid line in %s.\n", status_path.c_str());
+        close(status_fd);
+        return 1;
+    }
+    uid_line++;
+
+    size_t nprocs = pids.size();
+    results.push_back(measure("match_column", corpus, nprocs, [&]() {
+        free(match_column("Uid:", uid_line));
+    }));
+    results.push_back(measure("get_proc_info", corpus, nprocs, [&]() {
+        int uid, gid, pppid;
+        lseek(status_fd, 0, SEEK_SET);
+        get_proc_info(status_fd, &uid, &gid, &pppid);
+    }));
+    results.push_back(measure("getProcessBirthday", corpus, nprocs, [&]() {
+        getProcessBirthday(target);
+    }));
+    results.push_back(measure("create_identity", corpus, nprocs, [&]() {
+        create_identity(target, ppid);
+    }));
+    results.push_back(measure("mineProc", corpus, nprocs, [&]() {
+        AncestryHash ah;
+        ah.mineProc();
+    }));
+    results.push_back(measure("makeAncestry", corpus, nprocs, [&]() {
+        PidList ancestry;
+        gAH->makeAncestry(target, ancestry);
+    }));
+    results.push_back(measure("getJobIdentity", corpus, nprocs, [&]() {
+        getJobIdentity(target);
+    }));
+    results.push_back(measure("getHash", corpus, nprocs, [&]() {
+        free(getHash(target));
+    }));
+    close(status_fd);
+    return 0;
+}
+
+/*
+ * Baseline comparison.
+ */
+static bool json_field(const std::string &line, const char *key, std::string &value) {
+    std::string pattern = std::string("\"") + key + "\":";
+    size_t pos = line.find(pattern);
+    if (pos == std::string::npos) return false;
+    pos += pattern.size();
+    if (line[pos] == '"') {
+        size_t end = line.find('"', pos + 1);
+        if (end == std::string::npos) return false;
+        value = line.substr(pos + 1, end - pos - 1);
+    } else {
+        size_t end = line.find_first_of(",}", pos);
+        if (end == std::string::npos) return false;
+        value = line.substr(pos, end - pos);
+    }
+    return true;
+}
+
+static int compare_baseline(const char *baseline, double tolerance, const std::vector<Result> &results) {
+    std::ifstream in(baseline);
+    if (!in) {
+        fprintf(stderr, "Unable to open baseline %s.\n", baseline);
+        return 1;
+    }
+    std::map<std::string, std::string> lines;
+    std::string line, benchmark, corpus;
+    while (std::getline(in, line)) {
+        if (json_field(line, "benchmark", benchmark) && json_field(line, "corpus", corpus)) {
+            lines[benchmark + "|" + corpus] = line;
+        }
+    }
+
+    int regressions = 0;
+    for (std::vector<Result>::const_iterator it = results.begin(); it != results.end(); it++) {
+        std::map<std::string, std::string>::const_iterator base = lines.find(it->benchmark + "|" + it->corpus);
+        if (base == lines.end()) continue;
+        std::string ns, allocs, syscalls;
+        if (json_field(base->second, "ns_per_op", ns) && it->ns_per_op > atof(ns.c_str()) * (1 + tolerance / 100)) {
+            fprintf(stderr, "REGRESSION %s on %s: %.1f ns/op, baseline %s ns/op.\n",
+                it->benchmark.c_str(), it->corpus.c_str(), it->ns_per_op, ns.c_str());
+            regressions++;
+        }
+        // Allocation and system call counts are deterministic; any increase counts.
+        if (json_field(base->second, "allocs_per_op", allocs) && it->allocs_per_op > atof(allocs.c_str()) + 0.005) {
+            fprintf(stderr, "REGRESSION %s on %s: %.2f allocations/op, baseline %s.\n",
+                it->benchmark.c_str(), it->corpus.c_str(), it->allocs_per_op, allocs.c_str());
+            regressions++;
+        }
+        if (json_field(base->second, "syscalls_per_op", syscalls) && syscalls != "null" &&
+                it->syscalls_per_op >= 0 && it->syscalls_per_op > atof(syscalls.c_str()) + 0.005) {
+            fprintf(stderr, "REGRESSION %s on %s: %.2f syscalls/op, baseline %s.\n",
+                it->benchmark.c_str(), it->corpus.c_str(), it->syscalls_per_op, syscalls.c_str());
+            regressions++;
+        }
+    }
+    return regressions ? 1 : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s --record DIR\n"
+        "       %s --synthesize NPROCS DIR\n"
+        "       %s [--min-time MS] [--baseline FILE] [--tolerance PCT] CORPUS...\n",
+        prog, prog, prog);
+}
+
+int main(int argc, char **argv) {
+    const char *baseline = NULL;
+    double tolerance = BENCH_TOLERANCE_PCT;
+    std::vector<const char *> corpora;
+
+    for (int idx = 1; idx < argc; idx++) {
+        if (!strcmp(argv[idx], "--record") && idx + 1 < argc) {
+            return record_corpus(argv[idx + 1]);
+        } else if (!strcmp(argv[idx], "--synthesize") && idx + 2 < argc) {
+            int nprocs = atoi(argv[idx + 1]);
+            if (nprocs < 3) {
+                fprintf(stderr, "Need at least 3 processes for a synthetic corpus.\n");
+                return 1;
+            }
+            return synthesize_corpus(nprocs, argv[idx + 2]);
+        } else if (!strcmp(argv[idx], "--min-time") && idx + 1 < argc) {
+            g_min_time_ns = atof(argv[++idx]) * 1e6;
+        } else if (!strcmp(argv[idx], "--baseline") && idx + 1 < argc) {
+            baseline = argv[++idx];
+        } else if (!strcmp(argv[idx], "--tolerance") && idx + 1 < argc) {
+            tolerance = atof(argv[++idx]);
+        } else if (argv[idx][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            corpora.push_back(argv[idx]);
+        }
+    }
+    if (corpora.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Probing corpora for a target process logs every failed candidate.
+    tool_log_level = -1;
+
+    if ((g_syscall_fd = open_syscall_counter()) == -1) {
+        fprintf(stderr, "System call tracepoint unavailable; syscalls_per_op will be null.\n");
+    }
+
+    std::vector<Result> results;
+    for (std::vector<const char *>::const_iterator it = corpora.begin(); it != corpora.end(); it++) {
+        size_t first = results.size();
+        if (run_corpus(*it, results)) return 1;
+        for (size_t idx = first; idx < results.size(); idx++) {
+            print_result(results[idx]);
+        }
+    }
+    return baseline ? compare_baseline(baseline, tolerance, results) : 0;
+}
@@ -41,10 +41,16 @@ extern "C" {
 }
 
 #include "ancestry_hash.h"
+#include "probes.h"
+#include "trace_ring.h"
 
 #define PROC "/proc"
 static const char * logstr = "ancestry_hash";
 
+// Root of the process table; only the benchmark points this elsewhere
+// (at a recorded corpus of /proc status and stat files).
+static const char * proc_root = PROC;
+
 // Global variable
 class AncestryHash;
 AncestryHash *gAH;
@@ -52,6 +58,7 @@ AncestryHash *gAH;
 #ifdef HAVE_UNORDERED_MAP
 typedef std::unordered_map<pid_t, pid_t, std::hash<pid_t>, std::equal_to<pid_t> > PidPidMap;
 typedef std::unordered_map<pid_t, int, std::hash<pid_t>, std::equal_to<pid_t> > PidIntMap;
+typedef std::unordered_map<pid_t, unsigned long long, std::hash<pid_t>, std::equal_to<pid_t> > PidTimeMap;
 #else
 struct eqpid {
     bool operator()(const pid_t pid1, const pid_t pid2) const {
@@ -60,6 +67,7 @@ struct eqpid {
 };  
 typedef __gnu_cxx::hash_map<pid_t, pid_t, __gnu_cxx::hash<pid_t>, eqpid> PidPidMap;
 typedef __gnu_cxx::hash_map<pid_t, int, __gnu_cxx::hash<pid_t>, eqpid> PidIntMap;
+typedef __gnu_cxx::hash_map<pid_t, unsigned long long, __gnu_cxx::hash<pid_t>, eqpid> PidTimeMap;
 #endif
 typedef std::list<pid_t> PidList;
 
@@ -151,13 +159,26 @@ finalize:
 
 }
 
+// Start time (field 22) from the contents of a /proc/<pid>/stat file, or 0.
+// The command name may contain spaces and parentheses, so parse from the
+// last ')'.
+static unsigned long long parse_starttime(const char *buf) {
+    const char *end_comm = strrchr(buf, ')');
+    unsigned long long starttime;
+    if (!end_comm || (sscanf(end_comm+1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+        &starttime) != 1)) {
+        return 0;
+    }
+    return starttime;
+}
+
 extern "C"
 {
 unsigned long long
 getProcessBirthday(pid_t pid)
 {
-    char fixed_string[50];
-    if (snprintf(fixed_string, 50, "/proc/%d/stat", pid) >= 50)
+    char fixed_string[PATH_MAX];
+    if (snprintf(fixed_string, PATH_MAX, "%s/%d/stat", proc_root, pid) >= PATH_MAX)
     {
         return 0;
     }
@@ -174,56 +195,49 @@ getProcessBirthday(pid_t pid)
 }
 }
 
-// From a PID / PPID, create a unique hash, including the PID's creation timestamp.
-// The callee is responsible for 'free'ing the memory returned.
-// If this function returns NULL, it has encountered a fatal error.
-static char * create_hash(pid_t pid, pid_t ppid) {
-    char proc_file[20];
-    if (snprintf(proc_file, 20, "/proc/%d",pid) >= 20) {
-        lcmaps_log(0, "%s: Unable to open file in proc due to large PID %d.\n", logstr, pid);
-        return NULL;
-    }
+// From a PID / PPID, create a unique identity, including the PID's creation timestamp.
+// If the returned pid is 0, it has encountered a fatal error.
+static struct job_identity create_identity(pid_t pid, pid_t ppid) {
+    struct job_identity result = {0, 0, 0};
     unsigned long long bday;
     if ((bday = getProcessBirthday(pid)) == 0)
     {
         lcmaps_log(0, "%s: Unable to get process %d birthday.\n", logstr, pid);
-        return NULL;
-    }
-    char fixed_string[50];
-    int necessary_size = snprintf(fixed_string, 50, "%d:%d:%llu", pid, ppid, bday);
-    char * result = (char *)malloc(necessary_size+1);
-    if (result == NULL) {
-        lcmaps_log(0, "%s: Unable to allocate final string for the hash function.\n", logstr);
-        return NULL;
+        return result;
     }
-    if (snprintf(result, necessary_size+1, "%d:%d:%llu", pid, ppid, bday) >= necessary_size+1) {
-        lcmaps_log(0, "%s: Logic error in create_hash.\n", logstr);
-        return NULL;
-    }
-    lcmaps_log(5, "%s: Hash %s.\n", logstr, result);
+    result.pid = pid;
+    result.ppid = ppid;
+    result.starttime = bday;
+    trace_event(TRACE_HASH, pid, ppid, bday);
     return result;
 }
 
 class AncestryHash {
 
 public:
-    char * getHash(pid_t); // Note: Caller takes ownership of returned pointer on heap.
+    AncestryHash(bool starttimes = false) : want_starttimes(starttimes) {}
+    struct job_identity getIdentity(pid_t);
     int makeAncestry(pid_t, PidList&);
     int mineProc();
     int getParentIDs(pid_t, pid_t*, uid_t*, gid_t*);
+    int jobInSnapshot(const struct job_identity *);
 
 private:
+    bool want_starttimes;
     PidPidMap reverse_parentage_mapping;
     PidIntMap process_uid_mapping;
     PidIntMap process_gid_mapping;
+    PidTimeMap process_starttime_mapping;
 };
 
 int AncestryHash::mineProc() {
     DIR * dirp;
     struct dirent64 *dp;
     const char * name;
-    if ((dirp = opendir(PROC)) == NULL) {
-        lcmaps_log(0, "%s: Error - Unable to open /proc: %d %s\n", logstr, errno, strerror(errno));
+    PROBE(mineproc_entry);
+    if ((dirp = opendir(proc_root)) == NULL) {
+        lcmaps_log(0, "%s: Error - Unable to open %s: %d %s\n", logstr, proc_root, errno, strerror(errno));
+        PROBE(mineproc_return, errno, 0);
         return errno;
     }
     int dfd = dirfd(dirp);
@@ -256,6 +270,19 @@ int AncestryHash::mineProc() {
                 continue;
             }
             close(fd);
+            if (want_starttimes) {
+                // A process that exits in between is left out altogether.
+                char stat_buf[1024];
+                ssize_t len = -1;
+                if ((snprintf(path, sizeof(path), "%s/stat", name) < PATH_MAX) && ((fd = openat(dfd, path, O_RDONLY)) != -1)) {
+                    len = read(fd, stat_buf, sizeof(stat_buf)-1);
+                    close(fd);
+                }
+                if (len <= 0)
+                    continue;
+                stat_buf[len] = '\0';
+                process_starttime_mapping[proc] = parse_starttime(stat_buf);
+            }
             //std::cout << "Running process: " << name << " (uid=" << uid << ", gid=" << gid << ", ppid= " << ppid << ")" << std::endl;
             //lcmaps_log(0, "%s: Running process %s (uid=%d, gid=%d, ppid=%d)\n", name, uid, gid, ppid);
             reverse_parentage_mapping[proc] = ppid;
@@ -268,6 +295,7 @@ int AncestryHash::mineProc() {
         lcmaps_log(0, "%s: Error reading /proc directory: %d %s\n", logstr, errno, strerror(errno));
     }
     closedir(dirp);
+    PROBE(mineproc_return, 0, (int)reverse_parentage_mapping.size());
     return 0;
 }
 
@@ -290,7 +318,7 @@ int AncestryHash::makeAncestry(pid_t pid, PidList& ancestry) {
     return result;
 }
 
-char * AncestryHash::getHash(pid_t pid) {
+struct job_identity AncestryHash::getIdentity(pid_t pid) {
     /* General algorithm:
        1) Create a PidList "ancestry" where ancestry[0] = pid, ancestry[-1] = 1, and ancestry[n]'s PPID is ancestry[n+1]
        2) Set idx=0, orig_uid=uid(ancestry[0]), (ppid, pid) to NULL
@@ -298,17 +326,18 @@ char * AncestryHash::getHash(pid_t pid) {
        4) Update (ppid, pid).
        5) Increment idx by one; goto 3.
      */
+    const struct job_identity none = {0, 0, 0};
     PidList ancestry;
     int orig_uid = -1;
     int rc;
     if ((rc = makeAncestry(pid, ancestry))) {
         lcmaps_log(0, "%s: Error: unable to determine ancestry of %d: %d\n", logstr, pid, rc);
-        return NULL;
+        return none;
     }
 
     if (ancestry.size() < 3) { // glexec, pid, parent are required.
         lcmaps_log(0, "%s: Error - ancestry of %d is implausibly small.\n", logstr, pid);
-        return NULL;
+        return none;
     }
     PidList::const_iterator it;
     PidIntMap::const_iterator it2;
@@ -317,10 +346,10 @@ char * AncestryHash::getHash(pid_t pid) {
     int ppid = *it, pid_it = *it;
     for (; it != ancestry.end(); it++) {
         ppid = *it;
-        lcmaps_log(5, "%s: Considering ancestry of %d.\n", logstr, pid_it);
+        trace_event(TRACE_ANCESTOR, pid_it, 0, 0);
         if ((it2 = process_uid_mapping.find(*it)) == process_uid_mapping.end()) {
             lcmaps_log(0, "%s: Error - ancestor %d is not in UID map.\n", logstr, *it);
-            return NULL; // If we don't know the UID of an ancestor, something fishy is happening.  Bail.
+            return none; // If we don't know the UID of an ancestor, something fishy is happening.  Bail.
         }
         int uid = it2->second;
         if (orig_uid == -1) {
@@ -329,17 +358,17 @@ char * AncestryHash::getHash(pid_t pid) {
 
         // getParentIDs will verify the parentage, reducing the likelihood of a race attack.
         if (getParentIDs(pid_it, NULL, NULL, NULL) == -1) {
-            return NULL;
+            return none;
         }
 
         if (uid != orig_uid) { // Identified the UID transition
-            lcmaps_log(5, "%s: Found a UID transition from %d to %d.\n", logstr, ppid, pid_it);
-            return create_hash(pid_it, ppid);
+            trace_event(TRACE_UID_TRANSITION, ppid, pid_it, 0);
+            return create_identity(pid_it, ppid);
         }
         pid_it = *it;
     }
     lcmaps_log(0, "%s: Error - unable to determine hash from ancestry.");
-    return NULL;
+    return none;
 }
 
 int AncestryHash::getParentIDs(pid_t pid, pid_t *ppid, uid_t *uid, gid_t *gid) {
@@ -373,7 +402,7 @@ int AncestryHash::getParentIDs(pid_t pid, pid_t *ppid, uid_t *uid, gid_t *gid) {
         return -1;
     }
     old_ppid = it->second;
-    if (snprintf(path, PATH_MAX, "/proc/%d/status", pid) >= PATH_MAX) {
+    if (snprintf(path, PATH_MAX, "%s/%d/status", proc_root, pid) >= PATH_MAX) {
         lcmaps_log(0, "%s: Error - overly long PID: %d\n", logstr, pid);
         return -1;
     }
@@ -387,7 +416,7 @@ int AncestryHash::getParentIDs(pid_t pid, pid_t *ppid, uid_t *uid, gid_t *gid) {
         return -1;
     }
     close(fd);
-    lcmaps_log(5, "%s: PPID %d (new %d) for PID %d.\n", logstr, old_ppid, new_ppid, pid);
+    trace_event(TRACE_PARENT, pid, old_ppid, new_ppid);
     if (new_ppid != old_ppid) {
         lcmaps_log(0, "%s: Error - parent PID changed.  Possible race attack.  Old %d; new %d\n", logstr, old_ppid, new_ppid);
         return -1;
@@ -411,13 +440,63 @@ int AncestryHash::getParentIDs(pid_t pid, pid_t *ppid, uid_t *uid, gid_t *gid) {
 
 }
 
-char * getHash(pid_t proc) {
+int AncestryHash::jobInSnapshot(const struct job_identity *job) {
+    if (!want_starttimes) {
+        return -1;
+    }
+    PidPidMap::const_iterator it = reverse_parentage_mapping.find(job->pid);
+    PidTimeMap::const_iterator it2 = process_starttime_mapping.find(job->pid);
+    if ((it == reverse_parentage_mapping.end()) || (it2 == process_starttime_mapping.end())) {
+        return 0;
+    }
+    return (it->second == job->ppid) && (it2->second == job->starttime);
+}
+
+// Take the process snapshot up front; getHash and getParentIDs only read
+// it afterwards, so callers may then use them from several threads.
+int initAncestry() {
+    if (!gAH) {
+        gAH = new AncestryHash;
+        return gAH->mineProc();
+    }
+    return 0;
+}
+
+int initAncestrySnapshot() {
+    if (!gAH) {
+        gAH = new AncestryHash(true);
+        return gAH->mineProc();
+    }
+    return 0;
+}
+
+int jobInSnapshot(const struct job_identity *job) {
+    return gAH ? gAH->jobInSnapshot(job) : -1;
+}
+
+struct job_identity getJobIdentity(pid_t proc) {
+    PROBE(gethash_entry, proc);
     if (!gAH) {
         gAH = new AncestryHash;
         gAH->mineProc();
     }
-    lcmaps_log(5, "%s: Computing ancestry hash of %d.\n", logstr, proc);
-    return gAH->getHash(proc);
+    trace_event(TRACE_COMPUTE_HASH, proc, 0, 0);
+    struct job_identity id = gAH->getIdentity(proc);
+    PROBE(gethash_return, proc, id.pid ? 0 : -1);
+    return id;
+}
+
+char * getHash(pid_t proc) {
+    char buf[JOB_IDENTITY_LEN];
+    struct job_identity id = getJobIdentity(proc);
+    if ((id.pid == 0) || (formatJobIdentity(&id, buf, sizeof(buf)) == -1)) {
+        return NULL;
+    }
+    char * hash = strdup(buf);
+    if (hash == NULL) {
+        lcmaps_log(0, "%s: Unable to allocate final string for the hash function.\n", logstr);
+    }
+    return hash;
 }
 
 int getParentIDs(pid_t proc, pid_t *ppid, uid_t *uid, gid_t *gid) {
@@ -425,8 +504,6 @@ int getParentIDs(pid_t proc, pid_t *ppid, uid_t *uid, gid_t *gid) {
         gAH = new AncestryHash;
         gAH->mineProc();
     }
-    int retval = gAH->getParentIDs(proc, ppid, uid, gid);
-    lcmaps_log(5, "%s: PPID %d for PID %d.\n", logstr, ppid ? *ppid : -1, proc);
-    return retval;
+    return gAH->getParentIDs(proc, ppid, uid, gid);
 }
 
@@ -1,17 +1,63 @@
-
 #ifndef __ANCESTRY_HASH_H
 #define __ANCESTRY_HASH_H
 
+#include <stdio.h>
 #include <sys/types.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-char * getHash(pid_t);
+// Identifies a batch job: the process just below the UID transition in the
+// ancestry of a glexec invocation, its parent and its start time (clock
+// ticks since boot).  A pid of 0 means the job could not be identified.
+struct job_identity {
+    pid_t pid;
+    pid_t ppid;
+    unsigned long long starttime;
+};
+
+// Room for the text form, "pid:ppid:starttime", and its terminating NUL.
+#define JOB_IDENTITY_LEN 48
+
+int initAncestry(void);
+// Like initAncestry, but also records each process's start time, so that
+// jobInSnapshot can check jobs without going back to /proc.
+int initAncestrySnapshot(void);
+// Returns 1 if the job's process is in the snapshot with the recorded parent
+// and start time, 0 if it is not, and -1 if there is no such snapshot.
+int jobInSnapshot(const struct job_identity *);
+struct job_identity getJobIdentity(pid_t);
+char * getHash(pid_t); // Text form of getJobIdentity; caller frees it.
 int getParentIDs(pid_t, pid_t*, uid_t*, gid_t*);
 unsigned long long getProcessBirthday(pid_t);
 
+static inline int jobIdentityEqual(const struct job_identity *left, const struct job_identity *right)
+{
+    return (left->pid == right->pid) && (left->ppid == right->ppid) && (left->starttime == right->starttime);
+}
+
+// Write the text form into buf; returns its length, or -1 if it does not fit.
+static inline int formatJobIdentity(const struct job_identity *id, char *buf, size_t len)
+{
+    int needed = snprintf(buf, len, "%d:%d:%llu", (int)id->pid, (int)id->ppid, id->starttime);
+    return ((needed < 0) || ((size_t)needed >= len)) ? -1 : needed;
+}
+
+// Parse the text form at the start of str; returns the number of characters
+// consumed, or -1 if str does not start with an identity.
+static inline int parseJobIdentity(const char *str, struct job_identity *id)
+{
+    int pid, ppid, consumed = -1;
+    unsigned long long starttime;
+    if ((sscanf(str, "%d:%d:%llu%n", &pid, &ppid, &starttime, &consumed) != 3) || (consumed < 0))
+        return -1;
+    id->pid = pid;
+    id->ppid = ppid;
+    id->starttime = starttime;
+    return consumed;
+}
+
 #ifdef __cplusplus
 }
 #endif
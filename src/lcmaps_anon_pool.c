@@ -0,0 +1,454 @@
+/*
+ * lcmaps-plugins-anonymous-accounts
+ * This code is licensed under Apache v2.0
+ */
+
+/*
+ * lcmaps-anon-pool: audit and repair the pool account lock directory.
+ *
+ * Every lock file is validated against a single snapshot of /proc, taken
+ * in one pass before the audit starts, with the same criteria the plugin
+ * uses to decide whether an account is still in use; the workers the lock
+ * files are spread over do not read /proc themselves.  A record written
+ * after the snapshot was started is reported as "unknown".
+ *
+ * Usage:
+ *   lcmaps-anon-pool [options] list
+ *   lcmaps-anon-pool [options] release-stale
+ *   lcmaps-anon-pool [options] release ACCOUNT...
+ *   lcmaps-anon-pool [options] release-job [PID | PID:PPID:STARTTIME]
+ *   lcmaps-anon-pool [options] sweep
+ *
+ * release-job releases the account assigned to a job, so the next glexec
+ * invocation can take it right away.  Given no argument or a PID, the job is
+ * that of the calling process or of PID (root only), which must still be
+ * running; this suits glexec exit hooks.  Batch system epilogs run after the
+ * job's processes are gone, so they pass the job identity the plugin
+ * recorded (the OWNER column of "list") instead; it is looked up in the
+ * ".job:" index.
+ *
+ * sweep releases all accounts assigned before the last reboot, as the first
+ * glexec invocation after boot would; run it from a boot script to take
+ * that work off the first invocation.
+ *
+ * Options:
+ *   -lockpath DIR   lock directory (default as for the plugin)
+ *   -threads N      number of worker threads (default 8)
+ *   -v              log plugin debug messages to stderr
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "ancestry_hash.h"
+#include "pool_lock.h"
+#include "tool_log.h"
+#include "trace_ring.h"
+
+#define LOCKPATH_DEFAULT "/var/lock/lcmaps-plugins-anonymous-accounts"
+#define THREADS_DEFAULT 8
+
+enum account_state {
+  STATE_FREE,
+  STATE_IN_USE,
+  STATE_STALE,
+  STATE_UNKNOWN,
+  STATE_ERROR
+};
+
+static const char * state_names[] = {"free", "in-use", "stale", "unknown", "error"};
+
+enum pool_action {
+  ACTION_LIST,
+  ACTION_RELEASE_STALE,
+  ACTION_RELEASE,
+  ACTION_RELEASE_JOB,
+  ACTION_SWEEP
+};
+
+struct account_entry {
+  char name[256];
+  int selected;           // named on the command line for "release"
+  enum account_state state;
+  struct job_identity owner;
+  time_t mtime;
+  int released;
+};
+
+struct pool_audit {
+  int dir_fd;
+  enum pool_action action;
+  struct account_entry *entries;
+  size_t count;
+  struct job_identity job;  // job for release-job
+  struct timespec snapshot; // when the process snapshot was started
+  size_t next;            // next entry to hand to a worker
+  pthread_mutex_t mutex;
+};
+
+// Is the owner of a record still running?  Judged from the process snapshot
+// alone, with the same criteria as lock_record_live(): 1 if it is, 0 if it
+// exited (or its PID was reused) and -1 if the record was written after the
+// snapshot was started, so its job may be missing from it.
+static int record_live(const struct pool_audit *audit, const struct account_entry *entry, const struct stat *stat_buf)
+{
+  int live = jobInSnapshot(&entry->owner);
+  if (live != 0)
+    return live;
+  if ((stat_buf->st_mtim.tv_sec > audit->snapshot.tv_sec) ||
+      ((stat_buf->st_mtim.tv_sec == audit->snapshot.tv_sec) && (stat_buf->st_mtim.tv_nsec >= audit->snapshot.tv_nsec)))
+    return -1;
+  return 0;
+}
+
+// Release an account while holding its lock, exactly as the plugin would
+// see it.  Stale entries are only released if the record is unchanged
+// since it was audited.
+static int release_entry(int dir_fd, int fd, struct account_entry *entry, int force)
+{
+  struct job_identity owner;
+
+  if (flock(fd, LOCK_EX|LOCK_NB) == -1) {
+    fprintf(stderr, "Account %s is being assigned right now; not releasing it.\n", entry->name);
+    return -1;
+  }
+  if (!force) {
+    if ((read_lock_record(fd, &owner, NULL) != 1) || !jobIdentityEqual(&owner, &entry->owner)) {
+      fprintf(stderr, "Lock record of %s changed during the audit; not releasing it.\n", entry->name);
+      return -1;
+    }
+  }
+  return release_lock(dir_fd, fd);
+}
+
+static void audit_entry(struct pool_audit *audit, struct account_entry *entry)
+{
+  int fd = openat(audit->dir_fd, entry->name, O_RDWR);
+  if (fd == -1) {
+    fprintf(stderr, "Unable to open lock file %s (errno=%d, %s).\n", entry->name, errno, strerror(errno));
+    entry->state = STATE_ERROR;
+    return;
+  }
+
+  struct stat stat_buf;
+  if (fstat(fd, &stat_buf) == -1) {
+    fprintf(stderr, "Unable to stat lock file %s (errno=%d, %s).\n", entry->name, errno, strerror(errno));
+    entry->state = STATE_ERROR;
+    close(fd);
+    return;
+  }
+  entry->mtime = stat_buf.st_mtime;
+
+  int has_record = read_lock_record(fd, &entry->owner, NULL);
+  if ((audit->action == ACTION_RELEASE_JOB) && (has_record == 1)) {
+    // Only the job's own account matters; other jobs are not checked.
+    if (jobIdentityEqual(&entry->owner, &audit->job)) {
+      // Epilogs release the accounts of jobs that have already exited.
+      int live = record_live(audit, entry, &stat_buf);
+      entry->state = (live == 1) ? STATE_IN_USE : (live == 0) ? STATE_STALE : STATE_UNKNOWN;
+      entry->selected = 1;
+      entry->released = (release_entry(audit->dir_fd, fd, entry, 0) == 0);
+    }
+    close(fd);
+    return;
+  }
+
+  if (has_record == -1) {
+    entry->state = STATE_ERROR;
+  } else if (has_record == 0) {
+    entry->state = STATE_FREE;
+  } else {
+    switch (record_live(audit, entry, &stat_buf)) {
+    case 1:
+      entry->state = STATE_IN_USE;
+      break;
+    case 0:
+      entry->state = STATE_STALE;
+      break;
+    default:
+      // Not in the snapshot; err on the side of leaving it alone.
+      entry->state = STATE_UNKNOWN;
+      break;
+    }
+  }
+
+  if ((audit->action == ACTION_RELEASE_STALE) && (entry->state == STATE_STALE)) {
+    entry->released = (release_entry(audit->dir_fd, fd, entry, 0) == 0);
+  } else if ((audit->action == ACTION_RELEASE) && entry->selected && (entry->state != STATE_FREE)) {
+    entry->released = (release_entry(audit->dir_fd, fd, entry, 1) == 0);
+  }
+  close(fd);
+}
+
+static void * audit_worker(void *arg)
+{
+  struct pool_audit *audit = arg;
+
+  while (1) {
+    pthread_mutex_lock(&audit->mutex);
+    size_t idx = audit->next++;
+    pthread_mutex_unlock(&audit->mutex);
+    if (idx >= audit->count)
+      break;
+    audit_entry(audit, &audit->entries[idx]);
+  }
+  return NULL;
+}
+
+static int compare_entries(const void *left, const void *right)
+{
+  return strcmp(((const struct account_entry *)left)->name, ((const struct account_entry *)right)->name);
+}
+
+// Collect the lock file names; returns the number of entries or -1.
+static ssize_t load_entries(DIR *dir, struct account_entry **entries)
+{
+  size_t count = 0, capacity = 256;
+  struct dirent *dp;
+
+  *entries = malloc(capacity * sizeof(struct account_entry));
+  if (*entries == NULL)
+    return -1;
+  while ((dp = readdir(dir)) != NULL) {
+    if (dp->d_name[0] == '.')
+      continue;
+    if (dp->d_type != DT_REG && dp->d_type != DT_UNKNOWN)
+      continue;
+    if (count == capacity) {
+      capacity *= 2;
+      struct account_entry *tmp = realloc(*entries, capacity * sizeof(struct account_entry));
+      if (tmp == NULL)
+        return -1;
+      *entries = tmp;
+    }
+    memset(&(*entries)[count], 0, sizeof(struct account_entry));
+    snprintf((*entries)[count].name, sizeof((*entries)[count].name), "%s", dp->d_name);
+    count++;
+  }
+  qsort(*entries, count, sizeof(struct account_entry), compare_entries);
+  return count;
+}
+
+static void print_entries(const struct account_entry *entries, size_t count, enum pool_action action)
+{
+  time_t now = time(NULL);
+  size_t idx;
+
+  printf("%-16s %8s %-8s %10s  %s\n", "ACCOUNT", "UID", "STATE", "AGE(s)", "OWNER");
+  for (idx = 0; idx < count; idx++) {
+    const struct account_entry *entry = &entries[idx];
+    if (((action == ACTION_RELEASE) || (action == ACTION_RELEASE_JOB)) && !entry->selected)
+      continue;
+    struct passwd *pw = getpwnam(entry->name);
+    char uid[16], owner[JOB_IDENTITY_LEN];
+    if (pw)
+      snprintf(uid, sizeof(uid), "%d", (int)pw->pw_uid);
+    else
+      snprintf(uid, sizeof(uid), "-");
+    if ((entry->state == STATE_FREE) || (entry->state == STATE_ERROR))
+      snprintf(owner, sizeof(owner), "-");
+    else
+      formatJobIdentity(&entry->owner, owner, sizeof(owner));
+    printf("%-16s %8s %-8s %10ld  %s%s\n", entry->name, uid, state_names[entry->state],
+      entry->mtime ? (long)(now - entry->mtime) : -1L, owner, entry->released ? " (released)" : "");
+  }
+}
+
+static void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-lockpath DIR] [-threads N] [-v] list\n"
+    "       %s [-lockpath DIR] [-threads N] [-v] release-stale\n"
+    "       %s [-lockpath DIR] [-threads N] [-v] release ACCOUNT...\n"
+    "       %s [-lockpath DIR] [-threads N] [-v] release-job [PID | PID:PPID:STARTTIME]\n"
+    "       %s [-lockpath DIR] [-v] sweep\n", prog, prog, prog, prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+  const char *lockdir = LOCKPATH_DEFAULT;
+  int nthreads = THREADS_DEFAULT;
+  struct pool_audit audit;
+  int idx, failed = 0;
+
+  memset(&audit, 0, sizeof(audit));
+  for (idx = 1; idx < argc && argv[idx][0] == '-'; idx++) {
+    if (!strcmp(argv[idx], "-lockpath") && (idx+1 < argc)) {
+      lockdir = argv[++idx];
+    } else if (!strcmp(argv[idx], "-threads") && (idx+1 < argc)) {
+      nthreads = atoi(argv[++idx]);
+      if (nthreads < 1) nthreads = 1;
+    } else if (!strcmp(argv[idx], "-v")) {
+      tool_log_level = 5;
+      trace_echo = 1;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (idx == argc) {
+    usage(argv[0]);
+    return 2;
+  }
+  if (!strcmp(argv[idx], "list")) {
+    audit.action = ACTION_LIST;
+  } else if (!strcmp(argv[idx], "release-stale")) {
+    audit.action = ACTION_RELEASE_STALE;
+  } else if (!strcmp(argv[idx], "release") && (idx+1 < argc)) {
+    audit.action = ACTION_RELEASE;
+  } else if (!strcmp(argv[idx], "release-job") && (idx+2 >= argc)) {
+    audit.action = ACTION_RELEASE_JOB;
+  } else if (!strcmp(argv[idx], "sweep") && (idx+1 == argc)) {
+    audit.action = ACTION_SWEEP;
+  } else {
+    usage(argv[0]);
+    return 2;
+  }
+  idx++;
+
+  DIR *dir = opendir(lockdir);
+  if (dir == NULL) {
+    fprintf(stderr, "Unable to open lock directory %s (errno=%d, %s).\n", lockdir, errno, strerror(errno));
+    return 1;
+  }
+  audit.dir_fd = dirfd(dir);
+  // Read once, before the workers compare records against it.
+  get_boot_id();
+
+  if (audit.action == ACTION_SWEEP) {
+    int released = sweep_previous_boot(audit.dir_fd);
+    if (released == -1) {
+      fprintf(stderr, "Unable to sweep the lock directory %s.\n", lockdir);
+    } else {
+      printf("Released %d accounts assigned before the last reboot.\n", released);
+    }
+    closedir(dir);
+    return released == -1;
+  }
+  ssize_t count = load_entries(dir, &audit.entries);
+  if (count == -1) {
+    fprintf(stderr, "Unable to allocate memory for the account list.\n");
+    return 1;
+  }
+  audit.count = count;
+
+  for (; (audit.action == ACTION_RELEASE) && (idx < argc); idx++) {
+    struct account_entry key, *entry;
+    snprintf(key.name, sizeof(key.name), "%s", argv[idx]);
+    entry = bsearch(&key, audit.entries, audit.count, sizeof(struct account_entry), compare_entries);
+    if (entry == NULL) {
+      fprintf(stderr, "No lock file for account %s.\n", argv[idx]);
+      failed = 1;
+      continue;
+    }
+    entry->selected = 1;
+  }
+
+  // One snapshot of /proc, including start times, for all of the lock files.
+  clock_gettime(CLOCK_REALTIME, &audit.snapshot);
+  if (initAncestrySnapshot()) {
+    fprintf(stderr, "Unable to read the process table.\n");
+    return 1;
+  }
+
+  if ((audit.action == ACTION_RELEASE_JOB) && (idx < argc) && strchr(argv[idx], ':')) {
+    // A recorded identity; the job need not be running any more.
+    int consumed = parseJobIdentity(argv[idx], &audit.job);
+    if ((consumed == -1) || argv[idx][consumed] || (audit.job.pid == 0)) {
+      fprintf(stderr, "Invalid job identity %s.\n", argv[idx]);
+      return 2;
+    }
+    if (getuid() != 0) {
+      fprintf(stderr, "Only root may release the account of another job.\n");
+      return 1;
+    }
+  } else if (audit.action == ACTION_RELEASE_JOB) {
+    pid_t pid = getpid();
+    if (idx < argc) {
+      if ((sscanf(argv[idx], "%d", &pid) != 1) || (pid < 2)) {
+        fprintf(stderr, "Invalid PID %s.\n", argv[idx]);
+        return 2;
+      }
+      if (getuid() != 0) {
+        fprintf(stderr, "Only root may release the account of another process's job.\n");
+        return 1;
+      }
+    }
+    // Same identity the plugin computed when it assigned the account.
+    audit.job = getJobIdentity(pid);
+    if (audit.job.pid == 0) {
+      fprintf(stderr, "Unable to determine the batch job of process %d; is it still running?\n", pid);
+      return 1;
+    }
+  }
+
+  if (audit.action == ACTION_RELEASE_JOB) {
+    // The index names the job's account; only scan all lock files for
+    // records written before there was one.
+    char account[256];
+    struct account_entry key, *entry = NULL;
+    if (find_job_account(audit.dir_fd, &audit.job, account, sizeof(account)) == 0) {
+      snprintf(key.name, sizeof(key.name), "%s", account);
+      entry = bsearch(&key, audit.entries, audit.count, sizeof(struct account_entry), compare_entries);
+    }
+    if (entry) {
+      audit_entry(&audit, entry);
+      audit.next = audit.count;
+    }
+  }
+
+  pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+  if (threads == NULL) {
+    fprintf(stderr, "Unable to allocate memory for worker threads.\n");
+    return 1;
+  }
+  pthread_mutex_init(&audit.mutex, NULL);
+  int started = 0;
+  for (started = 0; started < nthreads; started++) {
+    if (pthread_create(&threads[started], NULL, audit_worker, &audit))
+      break;
+  }
+  if (started == 0) {
+    // Fall back to auditing in this thread.
+    audit_worker(&audit);
+  }
+  for (idx = 0; idx < started; idx++) {
+    pthread_join(threads[idx], NULL);
+  }
+  pthread_mutex_destroy(&audit.mutex);
+  free(threads);
+
+  print_entries(audit.entries, audit.count, audit.action);
+
+  size_t entry_idx, job_accounts = 0;
+  for (entry_idx = 0; entry_idx < audit.count; entry_idx++) {
+    const struct account_entry *entry = &audit.entries[entry_idx];
+    if (entry->state == STATE_ERROR)
+      failed = 1;
+    if ((audit.action == ACTION_RELEASE) && entry->selected && (entry->state != STATE_FREE) && !entry->released)
+      failed = 1;
+    if ((audit.action == ACTION_RELEASE_JOB) && entry->selected) {
+      job_accounts++;
+      if (!entry->released)
+        failed = 1;
+    }
+  }
+  if ((audit.action == ACTION_RELEASE_JOB) && (job_accounts == 0)) {
+    fprintf(stderr, "No account is assigned to this job.\n");
+    failed = 1;
+  }
+  free(audit.entries);
+  closedir(dir);
+  return failed;
+}
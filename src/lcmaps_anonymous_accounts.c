@@ -14,7 +14,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
-#include <dirent.h>
+#include <pwd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -26,6 +26,9 @@
 #include "lcmaps/lcmaps_arguments.h"
 
 #include "ancestry_hash.h"
+#include "pool_lock.h"
+#include "probes.h"
+#include "trace_ring.h"
 
 // Various necessary strings
 #define MINUID_ARG "-minuid"
@@ -33,6 +36,8 @@
 #define UID_DEFAULT -1
 #define LOCKPATH_ARG "-lockpath"
 #define LOCKPATH_DEFAULT "/var/lock/lcmaps-plugins-anonymous-accounts"
+#define POLICY_ARG "-policy"
+#define TRACE_ARG "-trace"
 
 // Refuse to hand out a UID lower than this one.
 // Selection of 1000 is done based on current (2012) RHEL guidelines.
@@ -40,90 +45,208 @@
 
 const char * logstr = "lcmaps-anonymous-accounts";
 
+// How to choose among the free accounts when the job has none yet.
+enum select_policy {
+  POLICY_FIRST_FIT,    // lowest free UID
+  POLICY_LRU,          // free account released the longest time ago
+  POLICY_AFFINITY      // account this pilot released last, otherwise as LRU
+};
+
+static const char * policy_names[] = {"first-fit", "lru", "affinity"};
+
+// When to log the debug trace of an invocation.
+enum trace_mode {
+  TRACE_DUMP_NEVER,
+  TRACE_DUMP_FAILURE,
+  TRACE_DUMP_ALWAYS
+};
+
+static const char * trace_mode_names[] = {"never", "failure", "always"};
+
+// Level at which a trace is dumped.
+#define TRACE_DUMP_LEVEL 1
+
+// A pool account, resolved by plugin_initialize.
+struct pool_account {
+  const char * name;     // points into account_names
+  int uid;
+  int gid;
+};
+
 // Plugin configurations
 static char * lockdir = NULL;
 static int min_uid = UID_DEFAULT;
 static int max_uid = UID_DEFAULT;
+static enum select_policy policy = POLICY_FIRST_FIT;
+static enum trace_mode trace_mode = TRACE_DUMP_FAILURE;
+
+// State derived from the configuration by plugin_initialize, so that hosts
+// keeping LCMAPS loaded do not redo it for every mapping.  Accounts added to
+// the UID range later are only seen after the plugin is reloaded.
+static struct pool_account * accounts = NULL;
+static int naccounts = 0;
+static char * account_names = NULL;    // all names, NUL-separated
+static int lockdir_fd = -1;
+static dev_t lockdir_dev;
+static ino_t lockdir_ino;
+
+// Basic permission checks on the lock directory; problems are logged at
+// level.  Returns -1 on failure and 0 on success.
+static int check_lockdir(const struct stat *stat_buf, int level) {
+  if (stat_buf->st_uid != 0) {
+    lcmaps_log_time(level, "%s: Lock directory (%s) not owned by root.\n", logstr, lockdir);
+    return -1;
+  }
+  if ((stat_buf->st_gid != 0) && ((stat_buf->st_mode & S_IWGRP) == S_IWGRP)) {
+    lcmaps_log_time(level, "%s: Lock directory (%s) is not owned by root group and is group writable.\n", logstr, lockdir);
+    return -1;
+  }
+  if (stat_buf->st_mode & S_IWOTH) {
+    lcmaps_log_time(level, "%s: Lock directory (%s) is world-writable.\n", logstr, lockdir);
+    return -1;
+  }
+  return 0;
+}
 
-// Open the directory, do basic permission checks.
+// Open the directory, do basic permission checks and remember which
+// directory it was.  Problems are logged at level.
 // Returns -1 on failure and an open FD on success
-static int open_lockdir() {
+static int open_lockdir(int level) {
 
-  DIR * dir = opendir(lockdir);
-  if (dir == NULL) {
-    lcmaps_log_time(0, "%s: Unable to open directory %s: (errno=%d, %s)\n", logstr, lockdir, errno, strerror(errno));
-    return -1;
-  }
-  int dir_fd = dirfd(dir);
+  int dir_fd = open(lockdir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
   if (dir_fd == -1) {
-    lcmaps_log_time(0, "%s: Unable to get directory fd %s: (errno=%d, %s)\n", logstr, lockdir, errno, strerror(errno));
+    lcmaps_log_time(level, "%s: Unable to open directory %s: (errno=%d, %s)\n", logstr, lockdir, errno, strerror(errno));
     return -1;
   }
   struct stat stat_buf;
   if (fstat(dir_fd, &stat_buf) == -1) {
-    lcmaps_log_time(0, "%s: Unable to stat the lock directory %s: (errno=%d, %s)\n", logstr, lockdir, errno, strerror(errno));
+    lcmaps_log_time(level, "%s: Unable to stat the lock directory %s: (errno=%d, %s)\n", logstr, lockdir, errno, strerror(errno));
+    close(dir_fd);
     return -1;
   }
-  if (stat_buf.st_uid != 0) {
-    lcmaps_log_time(0, "%s: Lock directory (%s) not owned by root.\n", logstr, lockdir);
+  if (check_lockdir(&stat_buf, level) == -1) {
+    close(dir_fd);
     return -1;
   }
-  if ((stat_buf.st_gid != 0) && ((stat_buf.st_mode & S_IWGRP) == S_IWGRP)) {
-    lcmaps_log_time(0, "%s: Lock directory (%s) is not owned by root group and is group writable.\n", logstr, lockdir);
-    return -1;
+  lockdir_dev = stat_buf.st_dev;
+  lockdir_ino = stat_buf.st_ino;
+  return dir_fd;
+}
+
+// Return the lock directory opened by plugin_initialize, after checking with
+// a single stat() that the path still leads to it and that it is still safe.
+// If the directory was replaced, open and check the new one.
+// Returns -1 on failure; the FD stays owned by the plugin.
+static int get_lockdir() {
+  struct stat stat_buf;
+
+  if (lockdir_fd != -1) {
+    if ((stat(lockdir, &stat_buf) == 0) && (stat_buf.st_dev == lockdir_dev) && (stat_buf.st_ino == lockdir_ino)) {
+      return (check_lockdir(&stat_buf, 0) == 0) ? lockdir_fd : -1;
+    }
+    lcmaps_log(1, "%s: Lock directory %s changed since the plugin was initialized; reopening it.\n", logstr, lockdir);
+    close(lockdir_fd);
   }
-  if (stat_buf.st_mode & S_IWOTH) {
-    lcmaps_log_time(0, "%s: Lock directory (%s) is world-writable.\n", logstr, lockdir);
+  lockdir_fd = open_lockdir(0);
+  return lockdir_fd;
+}
+
+// Resolve the UID range into the accounts table.
+// Returns -1 on failure and 0 on success.
+static int load_accounts() {
+  size_t names_len = 0, names_capacity = 1024;
+  int accounts_capacity = 64;
+  unsigned offset;
+  int idx;
+
+  // Left over if plugin_initialize runs again without plugin_terminate.
+  free(accounts);
+  free(account_names);
+  naccounts = 0;
+  // Sized by the accounts that exist, not by the UID range, which may be
+  // much wider.
+  accounts = malloc(accounts_capacity * sizeof(struct pool_account));
+  account_names = malloc(names_capacity);
+  if (!accounts || !account_names) {
+    lcmaps_log(0, "%s: Unable to allocate memory for the account table\n", logstr);
     return -1;
   }
-  return dir_fd;
+  // Count with an offset, so a range ending at INT_MAX does not overflow.
+  for (offset = 0; offset <= (unsigned)(max_uid - min_uid); offset++) {
+    int uid = min_uid + offset;
+    errno = 0; // errno set to 0 explicitly per comments in man page of getpwuid.
+    struct passwd *account = getpwuid(uid);
+    if (account == NULL) {
+      if (errno)
+        lcmaps_log(2, "%s: UID %d not found on system but is in UID range (errno=%d, %s).\n", logstr, uid, errno, strerror(errno));
+      else
+        lcmaps_log(4, "%s: UID %d not found on system but is in UID range.\n", logstr, uid);
+      continue;
+    }
+    size_t name_len = strlen(account->pw_name) + 1;
+    if (names_len + name_len > names_capacity) {
+      while (names_len + name_len > names_capacity)
+        names_capacity *= 2;
+      char *tmp = realloc(account_names, names_capacity);
+      if (tmp == NULL) {
+        lcmaps_log(0, "%s: Unable to allocate memory for the account table\n", logstr);
+        return -1;
+      }
+      account_names = tmp;
+    }
+    if (naccounts == accounts_capacity) {
+      struct pool_account *tmp = realloc(accounts, 2 * accounts_capacity * sizeof(struct pool_account));
+      if (tmp == NULL) {
+        lcmaps_log(0, "%s: Unable to allocate memory for the account table\n", logstr);
+        return -1;
+      }
+      accounts = tmp;
+      accounts_capacity *= 2;
+    }
+    memcpy(account_names + names_len, account->pw_name, name_len);
+    accounts[naccounts].uid = account->pw_uid;
+    accounts[naccounts].gid = account->pw_gid;
+    naccounts++;
+    names_len += name_len;
+  }
+  // The arena no longer moves; the names are in the same order as the
+  // accounts.
+  const char *name = account_names;
+  for (idx = 0; idx < naccounts; idx++) {
+    accounts[idx].name = name;
+    name += strlen(name) + 1;
+  }
+  return 0;
 }
 
 // Given a UID and an open FD, see if we are allowed to use it.
 //
-// We can use it if there is no process hash or the existing hash matches
-// ours.
+// We can use it if there is no job recorded or the recorded job is ours,
+// my_id.  A hash of another job only makes the account available if verify
+// is set and that job no longer exists; without verify, no /proc lookups
+// are done for other jobs' accounts.
 //
 // Returns 0 if account is available, -1 on failure, 1 if the account should not be used,
-// and 2 if the account matches this process
+// and 2 if the account matches this process.  pilot is set to the UID of
+// the pilot that last used the account, or -1.
 //
-static int check_account(int uid, int fd, char **account_hash) {
-  FILE * file = fdopen(fd, "r");
-  if (file == NULL) {
-    lcmaps_log(0, "%s: Unable to allocate file pointer for account %d.\n", logstr, uid);
-    return -1;
-  }
-  rewind(file);
-
-  int pid, ppid;
-  unsigned long long timestamp;
-  lcmaps_log(5, "%s: Checking validity of UID %d.\n", logstr, uid);
-
-  // Compute our hash.
-  char * new_hash = getHash(getpid());
-  if (new_hash == NULL) {
-    lcmaps_log(0, "%s: Unable to compute hash for my current process.\n", logstr);
-    return -1;
-  }
-  *account_hash = new_hash;
+static int check_account(int uid, int fd, const struct job_identity *my_id, int verify, uid_t *pilot) {
+  struct job_identity owner;
+  trace_event(TRACE_CHECK_ACCOUNT, uid, 0, 0);
 
   // Look for an existing hash.  No hash means we can use the account.
-  int matches = fscanf(file, "%d:%d:%llu", &pid, &ppid, &timestamp);
-  if (matches != 3) {
-    lcmaps_log(5, "%s: Invalid hash string in lock file (%d matches), so we can reuse it.\n", logstr, matches);
-    return 0;
-  }
-
-  int mypid, myppid;
-  unsigned long long mytimestamp;
-  if (sscanf(new_hash, "%d:%d:%llu", &mypid, &myppid, &mytimestamp) != 3) {
-    lcmaps_log(0, "%s: Incorrect format of new hash (%s).\n", logstr, new_hash);
+  int has_record = read_lock_record(fd, &owner, pilot);
+  if (has_record == -1) {
+    lcmaps_log(0, "%s: Unable to read lock file for account %d.\n", logstr, uid);
     return -1;
+  } else if (has_record == 0) {
+    trace_event(TRACE_RECORD_FREE, uid, 0, 0);
+    return 0;
   }
 
   // If hash on-disk is the same as ours, we can reuse this account.
-  if ((mypid == pid) && (myppid == ppid) && (mytimestamp == timestamp)) {
-    lcmaps_log(5, "%s: On-disk hash matches in-memory one; using account.\n", logstr);
+  if (jobIdentityEqual(&owner, my_id)) {
+    trace_event(TRACE_RECORD_OURS, uid, 0, 0);
     return 2;
   }
 
@@ -132,58 +255,131 @@ static int check_account(int uid, int fd, char **account_hash) {
   // because we can reuse the account.
   //
   // If we determine the hash is still valid, we cannot use this account (return 1).
-
-  // Check to see if the process's birthday is still correct.
-  lcmaps_log(5, "%s: Checking age of %d.\n", logstr, pid);
-  unsigned long long proc_bday = getProcessBirthday(pid);
-  if (timestamp != proc_bday) {
-    lcmaps_log(5, "%s: Re-using account because PID birthday does not match on-disk hash.\n", logstr);
+  if (!verify) {
+    trace_event(TRACE_RECORD_UNVERIFIED, uid, 0, 0);
+    return 1;
+  }
+  if (lock_record_live(&owner) != 1) {
+    trace_event(TRACE_RECORD_STALE, uid, 0, 0);
     return 0;
   }
 
-  int real_ppid;
-  if (getParentIDs(pid, &real_ppid, NULL, NULL)) {
-    lcmaps_log(0, "%s: Unable to retrieve parent of process %d.\n", logstr, pid);
+  // Hash is still valid, and it does not match ours.  Try again.
+  trace_event(TRACE_RECORD_LIVE, uid, 0, 0);
+  return 1;
+}
+
+// Decide whether a free account is a better choice than the one kept so
+// far under the configured policy.  released is when the account was last
+// released (zero if it never was) and pilot the UID that last used it.
+static int better_free_account(const struct timespec *released, uid_t pilot,
+    const struct timespec *best_released, uid_t best_pilot, uid_t my_pilot) {
+  int newer = (released->tv_sec != best_released->tv_sec) ?
+    (released->tv_sec > best_released->tv_sec) : (released->tv_nsec > best_released->tv_nsec);
+  int older = (released->tv_sec != best_released->tv_sec) ?
+    (released->tv_sec < best_released->tv_sec) : (released->tv_nsec < best_released->tv_nsec);
+
+  switch (policy) {
+  case POLICY_AFFINITY:
+    if ((pilot == my_pilot) != (best_pilot == my_pilot))
+      return pilot == my_pilot;
+    if (pilot == my_pilot)
+      return newer;
+    // Neither was used by this pilot, so the older one wins as under lru.
+    // fall through
+  case POLICY_LRU:
+    return older;
+  default:
     return 0;
   }
+}
 
-  if (real_ppid != ppid) {
-    lcmaps_log(5, "%s: Re-using account because PPID (%d) changed for PID %d from on-disk hash (%d).\n", logstr, real_ppid, pid, ppid);
-    return 0;
+// The pool account with the given name, or NULL.
+static const struct pool_account * lookup_account(const char *name) {
+  int idx;
+  for (idx = 0; idx < naccounts; idx++) {
+    if (strcmp(accounts[idx].name, name) == 0)
+      return &accounts[idx];
   }
+  return NULL;
+}
 
-  // Hash is still valid, and it does not match ours.  Try again.
-  lcmaps_log(5, "%s: Cannot re-use account - hash is still valid, and it does not match ours.\n", logstr);
-  return 1;
+// Follow our job's index entry to its account and confirm the record there
+// under the account's lock.  Returns the locked FD and sets *account, or -1
+// if the index does not lead to an account of our job.
+static int indexed_account(int dir_fd, const struct job_identity *my_id, const struct pool_account **account) {
+  char name[256];
+  struct job_identity owner;
+
+  if (find_job_account(dir_fd, my_id, name, sizeof(name)) == -1)
+    return -1;
+  if ((*account = lookup_account(name)) == NULL)
+    return -1;
+  int fd = openat(dir_fd, name, O_RDWR|O_NOFOLLOW);
+  if (fd == -1)
+    return -1;
+  // Another invocation from our job may hold the lock; it will not for long,
+  // and skipping the account would hand the job a second one.
+  if ((flock(fd, LOCK_EX) == -1) || (read_lock_record(fd, &owner, NULL) != 1) || !jobIdentityEqual(&owner, my_id)) {
+    close(fd);
+    return -1;
+  }
+  trace_event(TRACE_INDEXED_ACCOUNT, (*account)->uid, 0, 0);
+  return fd;
 }
 
-// Given a lock directory file descriptor, iterate through the possible
-// user names and select an unlocked account.
+// Given a lock directory file descriptor, iterate through the pool
+// accounts and select an unlocked account.
+//
+// A job that already holds an account is found through the ".job:" index.
+// If indexed is set, every record in the directory is indexed, so a job
+// without an entry holds no account and first-fit takes the first free
+// account it finds.  Otherwise (records written before the index existed)
+// the first pass also looks for a record of our job in every lock file.
 //
-// On success, account_name, hash and lockfile are changed to the name, hash
-// and location of the lockfile, respectively.  The callee is responsible for
-// calling 'free' on the memory.
+// The first pass keeps the free (released or never used) account preferred
+// by the policy locked as a fallback; it never looks at other jobs'
+// processes.  Only if no account is free does the second pass reclaim
+// accounts whose jobs have exited.  Under first-fit it takes the first one
+// found; the other policies check every account and choose among the
+// reclaimable ones the same way, with the lock file's mtime then being the
+// time the job was assigned it.
 //
-// Return -1 on failure.
-int select_account(int dir_fd, char **account_name, char **account_lockfile, char **account_hash, int *account_uid, int *account_gid) {
+// On success, account_name (the name of the lockfile as well), account_uid
+// and account_gid describe the account, and account_id is the identity of
+// our job.  The name belongs to the plugin.
+//
+// Return -1 on failure, and the locked lockfile's FD on success.
+int select_account(int dir_fd, int indexed, const char **account_name, struct job_identity *account_id, int *account_uid, int *account_gid) {
 
-  struct passwd *account;
-  int uid;
+  const struct pool_account *account, *free_account = NULL;
+  int idx;
   unsigned pass;
-  for (pass=0; pass < 2; pass++)
-  for (uid = min_uid; uid <= max_uid; uid++) {
+  int free_fd = -1;
+  struct timespec free_released = {0, 0};
+  uid_t free_pilot = -1, my_pilot = getuid();
+  PROBE(select_account_entry, min_uid, max_uid);
+  *account_id = getJobIdentity(getpid());
+  if (account_id->pid == 0) {
+    lcmaps_log(0, "%s: Unable to compute hash for my current process.\n", logstr);
+    PROBE(select_account_return, -1, -1);
+    return -1;
+  }
+  int own_fd = indexed_account(dir_fd, account_id, &account);
+  if (own_fd != -1) {
+    *account_name = account->name;
+    *account_uid = account->uid;
+    *account_gid = account->gid;
+    PROBE(select_account_return, account->uid, own_fd);
+    return own_fd;
+  }
+  for (pass=0; pass < 2; pass++) {
+  for (idx = 0; idx < naccounts; idx++) {
     int excl_failed = 0;
-    errno = 0; // errno set to 0 explicitly per comments in man page of getpwuid.
-    account = getpwuid(uid);
-    if (account == NULL) {
-      if (errno)
-        lcmaps_log(2, "%s: UID %d not found on system but is in UID range (errno=%d, %s).\n", logstr, uid, errno, strerror(errno));
-      else
-        lcmaps_log(4, "%s: UID %d not found on system but is in UID range.\n", logstr, uid);
-      continue;
-    }
-    const char * name = account->pw_name;
-    lcmaps_log(4, "%s: Considering mapping to account %s.\n", logstr, name);
+    account = &accounts[idx];
+    int uid = account->uid;
+    const char * name = account->name;
+    trace_event(TRACE_CONSIDER_ACCOUNT, uid, 0, 0);
     int fd = openat(dir_fd, name, O_RDWR|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
     if (fd == -1) {
       if (errno == EEXIST) {
@@ -203,9 +399,12 @@ int select_account(int dir_fd, char **account_name, char **account_lockfile, cha
       }
     }
 
-    if (flock(fd, LOCK_EX|LOCK_NB) == -1) {
+    PROBE(flock_entry, uid, fd);
+    int lock_rc = flock(fd, LOCK_EX|LOCK_NB);
+    PROBE(flock_result, uid, lock_rc, (lock_rc == -1) ? errno : 0);
+    if (lock_rc == -1) {
       if (errno == EWOULDBLOCK) {
-        lcmaps_log(5, "%s: Not assigning account %s because it is in use by another process.\n", logstr, name);
+        trace_event(TRACE_ACCOUNT_LOCKED, uid, 0, 0);
       } else {
         lcmaps_log(2, "%s: Not assigning account %s because of error (errno=%d, %s).\n", logstr, name, errno, strerror(errno));
       }
@@ -216,40 +415,72 @@ int select_account(int dir_fd, char **account_name, char **account_lockfile, cha
       //lcmaps_log(1, "%s: Locked an existing account file %s; likely means the monitoring process died unexpectedly or misconfiguration.\n", logstr, name);
     }
 
-    int account_validity = check_account(uid, fd, account_hash);
+    PROBE(check_account_entry, uid);
+    uid_t pilot;
+    int account_validity = check_account(uid, fd, account_id, pass, &pilot);
+    PROBE(check_account_return, uid, account_validity);
     if (account_validity == -1) {
       lcmaps_log(0, "%s: Fatal error while checking account validity.\n", logstr);
       close(fd);
+      if (free_fd != -1) close(free_fd);
+      PROBE(select_account_return, uid, -1);
       return -1;
     } else if (account_validity == 1) {
-      lcmaps_log(4, "%s: Tried account %s but it appears it is in use; will try another.\n", logstr, name);
+      trace_event(TRACE_ACCOUNT_IN_USE, uid, 0, 0);
       close(fd);
       continue;
-    } else if ((account_validity == 0) && (pass == 0)) {
+    } else if ((account_validity == 0) && (policy == POLICY_FIRST_FIT) && (indexed || (pass == 1))) {
+      // Nothing better can come after the first free account.
+      trace_event(TRACE_FREE_ACCOUNT, uid, policy, 0);
+    } else if (account_validity == 0) {
+      // Keep the best free account so far locked in case we own none.
+      // The lock file's mtime is the release (or, for a reclaimable
+      // account, assignment) time; a lock file we just created belongs to
+      // an account that was never used.
+      struct timespec released = {0, 0};
+      struct stat stat_buf;
+      if ((policy != POLICY_FIRST_FIT) && excl_failed && (fstat(fd, &stat_buf) == 0)) {
+        released = stat_buf.st_mtim;
+      }
+      if ((free_fd == -1) || better_free_account(&released, pilot, &free_released, free_pilot, my_pilot)) {
+        if (free_fd != -1) close(free_fd);
+        free_account = account;
+        free_fd = fd;
+        free_released = released;
+        free_pilot = pilot;
+      } else {
+        close(fd);
+      }
       continue;
     }
 
-    *account_name = strdup(name);
-    size_t lockfile_len = strlen(lockdir) + 1 + strlen(name) + 1;
-    *account_lockfile = malloc(lockfile_len);
-    if (!account_name || !account_lockfile) {
-      lcmaps_log(0, "%s: Unable to allocate memory for account name.\n", logstr);
-      close(fd);
-      return -1;
-    }
-    *account_uid = account->pw_uid;
-    *account_gid = account->pw_gid;
-    sprintf(*account_lockfile, "%s/%s", lockdir, name);
+    if (free_fd != -1) close(free_fd);
+    *account_name = name;
+    *account_uid = uid;
+    *account_gid = account->gid;
+    PROBE(select_account_return, uid, fd);
     return fd;
   }
 
+  if (free_fd != -1) {
+    trace_event(TRACE_FREE_ACCOUNT, free_account->uid, policy, 0);
+    *account_name = free_account->name;
+    *account_uid = free_account->uid;
+    *account_gid = free_account->gid;
+    PROBE(select_account_return, free_account->uid, free_fd);
+    return free_fd;
+  }
+  }
+
+  PROBE(select_account_return, -1, -1);
   return -1;
 }
 
 /******************************************************************************
 Function:   plugin_initialize
 Description:
-    Initialize plugin; a no-op, but required by LCMAPS
+    Initialize plugin: parse the options, resolve the UID range into the
+    account table and open the lock directory
 Parameters:
     argc, argv
     argv[0]: the name of the plugin
@@ -280,12 +511,35 @@ int plugin_initialize(int argc, char **argv)
       lcmaps_log(4, "%s: Max UID: %d.\n", logstr, max_uid);
     } else if ((strncasecmp(argv[idx], LOCKPATH_ARG, strlen(LOCKPATH_ARG)) == 0) && ((idx+1) < argc)) {
       idx++;
+      free(lockdir);
       lockdir = strdup(argv[idx]);
       if (lockdir == NULL) {
         lcmaps_log(0, "%s: Unable to allocate memory for lockdir\n", logstr);
         return LCMAPS_MOD_FAIL;
       }
       lcmaps_log(4, "%s: Lock directory: %s.\n", logstr, lockdir);
+    } else if ((strncasecmp(argv[idx], POLICY_ARG, strlen(POLICY_ARG)) == 0) && ((idx+1) < argc)) {
+      idx++;
+      for (policy = POLICY_FIRST_FIT; policy <= POLICY_AFFINITY; policy++) {
+        if (strcasecmp(argv[idx], policy_names[policy]) == 0)
+          break;
+      }
+      if (policy > POLICY_AFFINITY) {
+        lcmaps_log(0, "%s: Unknown selection policy %s (expected first-fit, lru or affinity)\n", logstr, argv[idx]);
+        return LCMAPS_MOD_FAIL;
+      }
+      lcmaps_log(4, "%s: Selection policy: %s.\n", logstr, policy_names[policy]);
+    } else if ((strncasecmp(argv[idx], TRACE_ARG, strlen(TRACE_ARG)) == 0) && ((idx+1) < argc)) {
+      idx++;
+      for (trace_mode = TRACE_DUMP_NEVER; trace_mode <= TRACE_DUMP_ALWAYS; trace_mode++) {
+        if (strcasecmp(argv[idx], trace_mode_names[trace_mode]) == 0)
+          break;
+      }
+      if (trace_mode > TRACE_DUMP_ALWAYS) {
+        lcmaps_log(0, "%s: Unknown trace mode %s (expected never, failure or always)\n", logstr, argv[idx]);
+        return LCMAPS_MOD_FAIL;
+      }
+      lcmaps_log(4, "%s: Trace dumps: %s.\n", logstr, trace_mode_names[trace_mode]);
     } else {
       lcmaps_log(0, "%s: Invalid plugin option: %s\n", logstr, argv[idx]);
       return LCMAPS_MOD_FAIL;
@@ -319,6 +573,17 @@ int plugin_initialize(int argc, char **argv)
 
   lcmaps_log(5, "%s: UID pool range: %d-%d, inclusive.\n", logstr, min_uid, max_uid);
 
+  if (load_accounts() == -1) {
+    return LCMAPS_MOD_FAIL;
+  }
+  lcmaps_log(5, "%s: %d accounts in the pool.\n", logstr, naccounts);
+
+  // Not fatal here; plugin_run will try again and report the failure, so
+  // only log it for debugging.
+  if (lockdir_fd != -1)
+    close(lockdir_fd);
+  lockdir_fd = open_lockdir(3);
+
   return LCMAPS_MOD_SUCCESS;
 
 }
@@ -348,6 +613,33 @@ int plugin_introspect(int *argc, lcmaps_argument_t **argv)
 
 
 
+// Record our job in the lock file of the account select_account() chose,
+// taking over the index entry of any previous owner.  The index must not
+// miss the record, as select_account() trusts it.
+// Returns -1 on failure and 0 on success.
+int assign_account(int dir_fd, int fd, const char *name, int uid, const struct job_identity *id) {
+  // Drop the index entry of the job we may be taking the account from.
+  struct job_identity old_owner;
+  if ((read_lock_record(fd, &old_owner, NULL) == 1) && !jobIdentityEqual(&old_owner, id)) {
+    unlink_job_account(dir_fd, &old_owner);
+  }
+
+  trace_event(TRACE_WRITE_RECORD, id->pid, id->ppid, id->starttime);
+  int written = write_lock_record(fd, id, getuid());
+  if (written == -1) {
+    int write_errno = errno;
+    lcmaps_log(0, "%s: Error when writing into the lockfile %s/%s (errno=%d, %s).\n", logstr, lockdir, name, write_errno, strerror(write_errno));
+    PROBE(lock_write, uid, 0, -write_errno);
+    return -1;
+  }
+  PROBE(lock_write, uid, written, 0);
+  if (link_job_account(dir_fd, id, name) == -1) {
+    lcmaps_log(0, "%s: Unable to index the account of this job (errno=%d, %s).\n", logstr, errno, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
 /******************************************************************************
 Function:   plugin_run
 Description:
@@ -361,80 +653,134 @@ Returns:
 ******************************************************************************/
 int plugin_run(int argc, lcmaps_argument_t *argv)
 {
+  PROBE(plugin_run_entry);
+  trace_reset();
 
-// Open the directory, do basic permission checks.
-  int dir_fd = open_lockdir();
+// Check the directory opened at initialization.
+  int dir_fd = get_lockdir();
   if (dir_fd == -1) {
-    goto opendir_failed;
+    goto run_failed;
   }
 
-  char * account_name = NULL;
-  char * account_hash = NULL, *account_lock = NULL;
+  // After a reboot, free the whole pool at once.  Should this fail, records
+  // from the earlier boot still count as free.  The sweep also indexes any
+  // record written before the index existed; without it (or a boot ID),
+  // select_account cannot rely on the index.
+  int indexed = (sweep_previous_boot(dir_fd) != -1) && get_boot_id()[0];
+
+  const char * account_name = NULL;
+  struct job_identity account_id;
   int account_uid = -1;
   int account_gid = -1;
-  int new_fd = select_account(dir_fd, &account_name, &account_lock, &account_hash, &account_uid, &account_gid);
+  int new_fd = select_account(dir_fd, indexed, &account_name, &account_id, &account_uid, &account_gid);
   if (new_fd == -1) {
-    goto select_account_failed;
+    goto run_failed;
   }
 
   lcmaps_log_time(0, "%s: Assigning %s to glexec invocation from pool accounts.\n", logstr, account_name);
-  free(account_name);
   addCredentialData(UID, &account_uid);
   addCredentialData(PRI_GID, &account_gid);
 
-  if (ftruncate(new_fd, 0) == -1) {
-    lcmaps_log(0, "%s: Unable to truncate lock file (errno=%d, %s).\n", logstr, errno, strerror(errno));
-    goto truncate_failed;
-  }
-
-  int nleft, nwritten;
-  nleft = strlen(account_hash);
-  lcmaps_log(5, "%s: Will write the following to the lockfile %s: %s (len %d)\n", logstr, account_lock, account_hash, strlen(account_hash));
-  lseek(new_fd, 0, SEEK_SET);
-  char * ptr = account_hash;
-  while (nleft > 0) {
-    nwritten = write(new_fd, ptr, nleft);
-    if (nwritten < 0) {
-      if (errno == EINTR) {
-        continue;
-      }
-      lcmaps_log(0, "%s: Error when writing into the lockfile %s (errno=%d, %s).\n", logstr, account_lock, errno, strerror(errno));
-      goto write_failed;
-    }
-    nleft -= nwritten;
-    ptr += nwritten;
+  if (assign_account(dir_fd, new_fd, account_name, account_uid, &account_id) == -1) {
+    goto write_failed;
   }
   close(new_fd);
-  close(dir_fd);
-  if (account_lock) free(account_lock);
-  if (account_hash) free(account_hash);
 
+  if (trace_mode == TRACE_DUMP_ALWAYS)
+    trace_dump(TRACE_DUMP_LEVEL);
+  PROBE(plugin_run_return, account_uid, LCMAPS_MOD_SUCCESS);
   return LCMAPS_MOD_SUCCESS;
 
 write_failed:
-  if (account_lock)
-    unlink(account_lock);
-truncate_failed:
+  unlinkat(dir_fd, account_name, 0);
   close(new_fd);
-  if (account_lock) free(account_lock);
-  if (account_hash) free(account_hash);
-select_account_failed:
-  close(dir_fd);
-opendir_failed:
+run_failed:
   lcmaps_log_time(0, "%s: Pool accounts plugin failed.\n", logstr);
+  if (trace_mode != TRACE_DUMP_NEVER)
+    trace_dump(TRACE_DUMP_LEVEL);
 
+  PROBE(plugin_run_return, -1, LCMAPS_MOD_FAIL);
   return LCMAPS_MOD_FAIL;
 }
 
+/******************************************************************************
+Function:   plugin_verify
+Description:
+    Check that this glexec invocation's job already holds a pool account,
+    without selecting or writing anything.
+Parameters:
+    argc: number of arguments
+    argv: list of arguments
+Returns:
+    LCMAPS_MOD_SUCCESS: the job holds an account
+    LCMAPS_MOD_FAIL   : it does not, or on failure
+******************************************************************************/
 int plugin_verify(int argc, lcmaps_argument_t * argv)
 {
-    return plugin_run(argc, argv);
+  char account_name[256];
+  struct job_identity my_id, owner;
+  int fd = -1;
+  int unassigned = 0;  // the expected failure; not worth a trace
+
+  trace_reset();
+
+  int dir_fd = get_lockdir();
+  if (dir_fd == -1) {
+    goto verify_failed;
+  }
+
+  my_id = getJobIdentity(getpid());
+  if (my_id.pid == 0) {
+    lcmaps_log(0, "%s: Unable to compute hash for my current process.\n", logstr);
+    goto verify_failed;
+  }
+  if (find_job_account(dir_fd, &my_id, account_name, sizeof(account_name)) == -1) {
+    lcmaps_log(1, "%s: No pool account is assigned to this job.\n", logstr);
+    unassigned = 1;
+    goto verify_failed;
+  }
+
+  const struct pool_account *account = lookup_account(account_name);
+  if (account == NULL) {
+    lcmaps_log(0, "%s: Indexed account %s is not in the pool.\n", logstr, account_name);
+    goto verify_failed;
+  }
+  int account_uid = account->uid;
+  int account_gid = account->gid;
+
+  // The index is only a hint; the lock record decides.  A shared lock keeps
+  // us from reading a record while it is being rewritten.
+  fd = openat(dir_fd, account_name, O_RDONLY|O_NOFOLLOW);
+  if ((fd == -1) || (flock(fd, LOCK_SH) == -1)) {
+    lcmaps_log(0, "%s: Unable to lock %s (errno=%d, %s).\n", logstr, account_name, errno, strerror(errno));
+    goto verify_failed;
+  }
+  if ((read_lock_record(fd, &owner, NULL) != 1) || !jobIdentityEqual(&owner, &my_id)) {
+    lcmaps_log(1, "%s: Account %s is no longer assigned to this job.\n", logstr, account_name);
+    unassigned = 1;
+    goto verify_failed;
+  }
+  close(fd);
+
+  lcmaps_log_time(0, "%s: Verified %s for glexec invocation from pool accounts.\n", logstr, account_name);
+  addCredentialData(UID, &account_uid);
+  addCredentialData(PRI_GID, &account_gid);
+  if (trace_mode == TRACE_DUMP_ALWAYS)
+    trace_dump(TRACE_DUMP_LEVEL);
+  return LCMAPS_MOD_SUCCESS;
+
+verify_failed:
+  if (fd != -1) close(fd);
+  lcmaps_log_time(0, "%s: Pool accounts plugin verification failed.\n", logstr);
+  if ((trace_mode == TRACE_DUMP_ALWAYS) || ((trace_mode == TRACE_DUMP_FAILURE) && !unassigned))
+    trace_dump(TRACE_DUMP_LEVEL);
+  return LCMAPS_MOD_FAIL;
 }
 
 /******************************************************************************
 Function:   plugin_terminate
 Description:
-    Terminate plugin.  Boilerplate - doesn't do anything
+    Terminate plugin.  Frees the state set up by plugin_initialize.
 Parameters:
 
 Returns:
@@ -444,6 +790,15 @@ int plugin_terminate()
 {
   if (lockdir)
     free(lockdir);
+  lockdir = NULL;
+  if (lockdir_fd != -1)
+    close(lockdir_fd);
+  lockdir_fd = -1;
+  free(accounts);
+  accounts = NULL;
+  naccounts = 0;
+  free(account_names);
+  account_names = NULL;
 
   return LCMAPS_MOD_SUCCESS;
 }
@@ -0,0 +1,352 @@
+/*
+ * lcmaps-plugins-anonymous-accounts
+ * This code is licensed under Apache v2.0
+ */
+
+/*
+ * Lock file records shared by the plugin and the lcmaps-anon-pool tool.
+ *
+ * Each pool account has a lock file named after the account; while the
+ * account is assigned, it contains the "pid:ppid:birthday" hash of the
+ * owning batch job (see ancestry_hash.cxx), followed by ":pilot", the UID
+ * the job runs as, and ":boot_id", the kernel's boot ID.  A released account
+ * keeps only "free:pilot", and the lock file's mtime records when it was
+ * released.  Records without a pilot UID or boot ID, as written by older
+ * versions, are still accepted.
+ *
+ * PIDs and start times only mean something within one boot, so a record
+ * with another boot ID marks the account as free without looking at /proc.
+ * The first invocation after a reboot releases all such accounts at once
+ * and records the boot ID in ".boot_id".
+ *
+ * Next to the lock files, the ".job:" symlinks index assigned accounts by
+ * job.  The same sweep rebuilds the index from the remaining records, so
+ * that once ".boot_id" is current every record is indexed and a job
+ * without an entry holds no account.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "lcmaps/lcmaps_log.h"
+
+#include "ancestry_hash.h"
+#include "pool_lock.h"
+#include "trace_ring.h"
+
+#define JOB_INDEX_PREFIX ".job:"
+#define BOOT_MARKER ".boot_id"
+#define BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+
+static const char * logstr = "pool_lock";
+static char boot_id[40];
+static int boot_id_read = 0;
+
+const char * get_boot_id(void)
+{
+  if (!boot_id_read) {
+    FILE *fp = fopen(BOOT_ID_PATH, "r");
+    if ((fp == NULL) || (fscanf(fp, "%39s", boot_id) != 1)) {
+      lcmaps_log(2, "%s: Unable to read boot ID from %s; records will not carry one.\n", logstr, BOOT_ID_PATH);
+      boot_id[0] = '\0';
+    }
+    if (fp) fclose(fp);
+    boot_id_read = 1;
+  }
+  return boot_id;
+}
+
+// Name of a job's index entry; returns -1 if it does not fit.
+static int job_index_name(const struct job_identity *job, char *name, size_t len)
+{
+  size_t prefix_len = strlen(JOB_INDEX_PREFIX);
+  if (len <= prefix_len)
+    return -1;
+  memcpy(name, JOB_INDEX_PREFIX, prefix_len);
+  return formatJobIdentity(job, name + prefix_len, len - prefix_len);
+}
+
+// Read and parse a lock record.  Returns 1 if the record names a job of
+// this boot (or does not say), 2 if it names a job of an earlier boot, 0 if
+// there is no valid record and -1 on I/O error.
+static int read_record(int fd, struct job_identity *owner, uid_t *pilot)
+{
+  char buffer[128];
+  ssize_t len;
+  unsigned last_pilot;
+  int pilot_len = -1;
+
+  do {
+    len = pread(fd, buffer, sizeof(buffer)-1, 0);
+  } while ((len == -1) && (errno == EINTR));
+  if (len == -1) {
+    lcmaps_log(0, "%s: Unable to read lock file (errno=%d, %s).\n", logstr, errno, strerror(errno));
+    return -1;
+  }
+  buffer[len] = '\0';
+
+  int consumed = parseJobIdentity(buffer, owner);
+  if (consumed == -1) {
+    if (pilot) {
+      *pilot = (sscanf(buffer, "free:%u", &last_pilot) == 1) ? last_pilot : (uid_t)-1;
+    }
+    trace_event(TRACE_INVALID_RECORD, 0, 0, 0);
+    return 0;
+  }
+  const char *rest = buffer + consumed;
+  if ((sscanf(rest, ":%u%n", &last_pilot, &pilot_len) == 1) && (pilot_len > 0)) {
+    rest += pilot_len;
+  } else {
+    last_pilot = -1;
+  }
+  if (pilot) {
+    *pilot = last_pilot;
+  }
+  const char *current = get_boot_id();
+  if ((rest[0] == ':') && current[0] && strcmp(rest+1, current)) {
+    trace_event(TRACE_EARLIER_BOOT, 0, 0, 0);
+    return 2;
+  }
+  return 1;
+}
+
+int read_lock_record(int fd, struct job_identity *owner, uid_t *pilot)
+{
+  int rc = read_record(fd, owner, pilot);
+  return (rc == 2) ? 0 : rc;
+}
+
+int lock_record_live(const struct job_identity *owner)
+{
+  pid_t pid = owner->pid, ppid = owner->ppid;
+
+  // If the process exited or its information changed, the record is stale.
+
+  // Check to see if the process's birthday is still correct.
+  trace_event(TRACE_CHECK_AGE, pid, 0, 0);
+  unsigned long long proc_bday = getProcessBirthday(pid);
+  if (owner->starttime != proc_bday) {
+    trace_event(TRACE_BIRTHDAY_CHANGED, pid, 0, 0);
+    return 0;
+  }
+
+  int real_ppid;
+  if (getParentIDs(pid, &real_ppid, NULL, NULL)) {
+    lcmaps_log(0, "%s: Unable to retrieve parent of process %d.\n", logstr, pid);
+    return -1;
+  }
+
+  if (real_ppid != ppid) {
+    trace_event(TRACE_PARENT_CHANGED, pid, real_ppid, ppid);
+    return 0;
+  }
+
+  return 1;
+}
+
+// Write a record at the start of the lock file and truncate it there.
+static int write_record(int fd, const char *record)
+{
+  size_t nleft = strlen(record);
+  off_t offset = 0;
+
+  while (nleft > 0) {
+    ssize_t nwritten = pwrite(fd, record + offset, nleft, offset);
+    if (nwritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    nleft -= nwritten;
+    offset += nwritten;
+  }
+  // Drop whatever is left of a longer, previous record.
+  return ftruncate(fd, offset);
+}
+
+int write_lock_record(int fd, const struct job_identity *owner, uid_t pilot)
+{
+  char record[JOB_IDENTITY_LEN + 64];
+  int len = formatJobIdentity(owner, record, sizeof(record));
+  const char *current = get_boot_id();
+
+  if (len != -1) {
+    len += snprintf(record + len, sizeof(record) - len, current[0] ? ":%u:%s" : ":%u", (unsigned)pilot, current);
+  }
+  if ((len == -1) || (len >= (int)sizeof(record))) {
+    errno = EINVAL;
+    return -1;
+  }
+  return (write_record(fd, record) == -1) ? -1 : len;
+}
+
+int release_lock(int dir_fd, int fd)
+{
+  char record[32] = "";
+  struct job_identity owner;
+  uid_t pilot;
+
+  int has_record = read_lock_record(fd, &owner, &pilot);
+  if (has_record == 1) {
+    unlink_job_account(dir_fd, &owner);
+  }
+  if ((has_record != -1) && (pilot != (uid_t)-1)) {
+    snprintf(record, sizeof(record), "free:%u", (unsigned)pilot);
+  }
+  if (write_record(fd, record) == -1) {
+    lcmaps_log(0, "%s: Unable to release lock file (errno=%d, %s).\n", logstr, errno, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int link_job_account(int dir_fd, const struct job_identity *job, const char *account)
+{
+  char name[sizeof(JOB_INDEX_PREFIX) + JOB_IDENTITY_LEN];
+  char current[256];
+
+  if (job_index_name(job, name, sizeof(name)) == -1) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  while (symlinkat(account, dir_fd, name) == -1) {
+    if (errno != EEXIST)
+      return -1;
+    // Left over from an earlier assignment; keep it if it is still right.
+    ssize_t len = readlinkat(dir_fd, name, current, sizeof(current)-1);
+    if (len >= 0) {
+      current[len] = '\0';
+      if (strcmp(current, account) == 0)
+        return 0;
+    }
+    if ((unlinkat(dir_fd, name, 0) == -1) && (errno != ENOENT))
+      return -1;
+  }
+  return 0;
+}
+
+int find_job_account(int dir_fd, const struct job_identity *job, char *account, size_t len)
+{
+  char name[sizeof(JOB_INDEX_PREFIX) + JOB_IDENTITY_LEN];
+
+  if ((len == 0) || (job_index_name(job, name, sizeof(name)) == -1))
+    return -1;
+  ssize_t link_len = readlinkat(dir_fd, name, account, len-1);
+  if ((link_len <= 0) || ((size_t)link_len >= len-1))
+    return -1;
+  account[link_len] = '\0';
+  // Only ever a lock file in the same directory.
+  if (strchr(account, '/') || (account[0] == '.'))
+    return -1;
+  return 0;
+}
+
+void unlink_job_account(int dir_fd, const struct job_identity *job)
+{
+  char name[sizeof(JOB_INDEX_PREFIX) + JOB_IDENTITY_LEN];
+
+  if ((job_index_name(job, name, sizeof(name)) != -1) && (unlinkat(dir_fd, name, 0) == -1) && (errno != ENOENT)) {
+    lcmaps_log(2, "%s: Unable to remove index entry %s (errno=%d, %s).\n", logstr, name, errno, strerror(errno));
+  }
+}
+
+// Does the marker in fd hold the current boot ID?
+static int marker_current(int fd, const char *current)
+{
+  char marker[sizeof(boot_id)];
+  ssize_t len = pread(fd, marker, sizeof(marker)-1, 0);
+  if (len < 0)
+    return 0;
+  marker[len] = '\0';
+  return strcmp(marker, current) == 0;
+}
+
+int sweep_previous_boot(int dir_fd)
+{
+  const char *current = get_boot_id();
+  if (!current[0])
+    return 0;
+
+  int marker_fd = openat(dir_fd, BOOT_MARKER, O_RDWR|O_CREAT|O_NOFOLLOW, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+  if (marker_fd == -1) {
+    lcmaps_log(0, "%s: Unable to open %s (errno=%d, %s).\n", logstr, BOOT_MARKER, errno, strerror(errno));
+    return -1;
+  }
+  if (marker_current(marker_fd, current)) {
+    close(marker_fd);
+    return 0;
+  }
+  // Everybody else waits here until the sweep is done, so no account of
+  // this boot is assigned before it.
+  if (flock(marker_fd, LOCK_EX) == -1) {
+    lcmaps_log(0, "%s: Unable to lock %s (errno=%d, %s).\n", logstr, BOOT_MARKER, errno, strerror(errno));
+    close(marker_fd);
+    return -1;
+  }
+  if (marker_current(marker_fd, current)) {
+    close(marker_fd);
+    return 0;
+  }
+
+  int list_fd = openat(dir_fd, ".", O_RDONLY|O_DIRECTORY);
+  DIR *dir = (list_fd == -1) ? NULL : fdopendir(list_fd);
+  if (dir == NULL) {
+    lcmaps_log(0, "%s: Unable to list the lock directory (errno=%d, %s).\n", logstr, errno, strerror(errno));
+    if (list_fd != -1) close(list_fd);
+    close(marker_fd);
+    return -1;
+  }
+  // Drop the whole index first, then release or index every record; new
+  // entries must not be seen by the first loop.
+  int released = 0, unindexed = 0;
+  struct dirent *dp;
+  while ((dp = readdir(dir)) != NULL) {
+    if (strncmp(dp->d_name, JOB_INDEX_PREFIX, strlen(JOB_INDEX_PREFIX)) == 0) {
+      unlinkat(dir_fd, dp->d_name, 0);
+    }
+  }
+  rewinddir(dir);
+  while ((dp = readdir(dir)) != NULL) {
+    if (dp->d_name[0] == '.')
+      continue;
+    int fd = openat(dir_fd, dp->d_name, O_RDWR|O_NOFOLLOW);
+    if (fd == -1)
+      continue;
+    // Nobody holds an account lock while waiting for the marker, so this
+    // only waits for invocations that got in before the sweep.
+    struct job_identity owner;
+    int has_record = (flock(fd, LOCK_EX) == 0) ? read_record(fd, &owner, NULL) : -1;
+    if (has_record == 2) {
+      if (release_lock(dir_fd, fd) == 0)
+        released++;
+    } else if ((has_record == -1) || ((has_record == 1) && (link_job_account(dir_fd, &owner, dp->d_name) == -1))) {
+      unindexed++;
+    }
+    close(fd);
+  }
+  closedir(dir);
+
+  int rc = released;
+  if (unindexed) {
+    // Leave the marker alone so that the next invocation tries again.
+    lcmaps_log(0, "%s: Unable to index %d accounts.\n", logstr, unindexed);
+    close(marker_fd);
+    return -1;
+  }
+  if (write_record(marker_fd, current) == -1) {
+    lcmaps_log(0, "%s: Unable to write %s (errno=%d, %s).\n", logstr, BOOT_MARKER, errno, strerror(errno));
+    rc = -1;
+  }
+  close(marker_fd);
+  lcmaps_log(3, "%s: Released %d accounts assigned before the last reboot.\n", logstr, released);
+  return rc;
+}
@@ -0,0 +1,67 @@
+
+#ifndef __POOL_LOCK_H
+#define __POOL_LOCK_H
+
+#include <sys/types.h>
+
+#include "ancestry_hash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Read the job recorded in an account's lock file.
+// Returns 1 if a record was found, 0 if the file holds no valid record or a
+// record from an earlier boot (the account is free) and -1 on I/O error.
+// If pilot is not NULL, it is set to the UID of the pilot that last used the
+// account, or -1.
+int read_lock_record(int fd, struct job_identity *owner, uid_t *pilot);
+
+// Check whether the job that recorded a lock file still exists.
+// Returns 1 if it does, 0 if the record is stale, and -1 if the owner
+// could not be found in the process snapshot (e.g., it started after it
+// was taken).
+int lock_record_live(const struct job_identity *owner);
+
+// Replace the record in a lock file with a job, the UID of the pilot it
+// runs as and the current boot ID.  Returns the length of the record on
+// success and -1 on failure, with errno set.
+int write_lock_record(int fd, const struct job_identity *owner, uid_t pilot);
+
+// Release an account by removing the job hash from its lock file and the
+// job's index entry from dir_fd; the pilot UID is kept for the affinity
+// policy.  The caller must hold the flock on fd.  Returns 0 on success and
+// -1 on failure.
+int release_lock(int dir_fd, int fd);
+
+// The index maps a job to its account with a symlink named after the job
+// (".job:pid:ppid:starttime") pointing at the account's lock file, so the
+// account can be found without scanning the pool.  The lock record stays
+// authoritative; an index entry is only a hint.
+
+// Point the job's index entry at account.  Returns 0 on success and -1 on
+// failure, with errno set.
+int link_job_account(int dir_fd, const struct job_identity *job, const char *account);
+
+// Look up the account of a job in the index.  Returns 0 and copies the
+// account name into account on success, and -1 if the job has no entry.
+int find_job_account(int dir_fd, const struct job_identity *job, char *account, size_t len);
+
+// Remove the job's index entry, if any.
+void unlink_job_account(int dir_fd, const struct job_identity *job);
+
+// The kernel's boot ID, or "" if it is unknown.  It is read on the first
+// call, which must happen before any threads use the functions above.
+const char * get_boot_id(void);
+
+// Once per boot, release every account whose record is from an earlier boot
+// and rebuild the index from the other records.  Returns the number of
+// accounts released (0 if the sweep was already done) or -1 on failure, in
+// which case the index may be incomplete.
+int sweep_previous_boot(int dir_fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
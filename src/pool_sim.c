@@ -0,0 +1,616 @@
+/*
+ * lcmaps-plugins-anonymous-accounts
+ * This code is licensed under Apache v2.0
+ */
+
+/*
+ * pool_sim: replay job traces against the plugin's account selection.
+ *
+ * The real select_account() / check_account() from the plugin run against
+ * a lock directory in memory (on /dev/shm when available) and against an
+ * in-memory process table that stands in for ancestry_hash.cxx.  For every
+ * glexec event the simulator records how many accounts were probed and how
+ * many other jobs had to be verified in /proc, and turns that into a
+ * simulated latency with a simple cost model.
+ *
+ * Trace format, one event per line ('#' starts a comment):
+ *
+ *   <seconds> start <job>     batch job (pilot) starts
+ *   <seconds> glexec <job>    the job maps a payload through the plugin
+ *   <seconds> release <job>   epilog / exit hook releases the job's account
+ *   <seconds> stop <job>      the job's processes exit
+ *
+ * Usage:
+ *   pool_sim [options] TRACE -- PLUGIN-OPTIONS
+ *   pool_sim [options] -synthetic JOBS -- PLUGIN-OPTIONS
+ *
+ * PLUGIN-OPTIONS are passed to plugin_initialize (e.g. "-minuid 20000
+ * -maxuid 20099 -policy lru"), so one trace can be replayed with different
+ * pool sizes and selection policies.  Job N runs under pilot UID N modulo
+ * the number of pilots, and lock file times follow the trace clock.
+ *
+ * Options:
+ *   -series FILE         write "time occupied stale" after every event
+ *   -dump FILE           write the (synthetic) trace that was replayed
+ *   -probe-us US         cost of probing one account (default 15)
+ *   -verify-us US        cost of verifying another job in /proc (default 40)
+ *   -base-us US          fixed cost per invocation, e.g. reading /proc (default 2000)
+ *   -pilots N            number of distinct pilot UIDs (default 1)
+ *   -v                   log plugin debug messages to stderr
+ * Synthetic trace options:
+ *   -rate JOBS/S         job arrival rate (default 1)
+ *   -duration S          mean job length (default 3600)
+ *   -glexecs N           glexec invocations per job (default 3)
+ *   -release-fraction F  fraction of jobs that release explicitly (default 0)
+ *   -seed N              random seed (default 1)
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "ancestry_hash.h"
+#include "pool_lock.h"
+#include "tool_log.h"
+#include "trace_ring.h"
+
+#define SIM_PROBE_US 15.0
+#define SIM_VERIFY_US 40.0
+#define SIM_BASE_US 2000.0
+#define SIM_TICKS 100        // starttime units per second, as USER_HZ
+#define SIM_PILOT_UID 500    // UID of the first pilot
+
+// Provided by the plugin.
+int plugin_initialize(int argc, char **argv);
+int plugin_terminate(void);
+int select_account(int dir_fd, int indexed, const char **account_name, struct job_identity *account_id, int *account_uid, int *account_gid);
+int assign_account(int dir_fd, int fd, const char *name, int uid, const struct job_identity *id);
+
+enum event_type {
+  EVENT_START,
+  EVENT_GLEXEC,
+  EVENT_RELEASE,
+  EVENT_STOP
+};
+
+static const char * event_names[] = {"start", "glexec", "release", "stop"};
+
+struct event {
+  double time;
+  enum event_type type;
+  int job;
+};
+
+struct job {
+  int started, alive;
+  pid_t pid, ppid;          // the UID transition the plugin hashes
+  unsigned long long starttime;
+  int account;              // UID last assigned, or -1
+  uid_t pilot;              // UID the job runs as
+};
+
+// Simulated process table.
+static struct job *jobs = NULL;
+static int njobs = 0;
+static int current_job = -1;       // job of the glexec being simulated
+
+// Per-invocation counters.
+static unsigned long probes = 0;
+static unsigned long verifications = 0;
+
+// Job N runs as PID 1001+2N below its parent 1000+2N; PIDs are not reused.
+static struct job * job_by_pid(pid_t pid)
+{
+  int idx = (pid - 1000) / 2;
+  if ((pid < 1000) || (idx >= njobs) || (jobs[idx].pid != pid) || !jobs[idx].alive)
+    return NULL;
+  return &jobs[idx];
+}
+
+/*
+ * Stand-ins for ancestry_hash.cxx.
+ */
+int initAncestry(void)
+{
+  return 0;
+}
+
+struct job_identity getJobIdentity(pid_t pid)
+{
+  struct job_identity id = {0, 0, 0};
+
+  if (current_job >= 0) {
+    id.pid = jobs[current_job].pid;
+    id.ppid = jobs[current_job].ppid;
+    id.starttime = jobs[current_job].starttime;
+  }
+  return id;
+}
+
+unsigned long long getProcessBirthday(pid_t pid)
+{
+  struct job *job = job_by_pid(pid);
+  verifications++;
+  return job ? job->starttime : 0;
+}
+
+int getParentIDs(pid_t pid, pid_t *ppid, uid_t *uid, gid_t *gid)
+{
+  struct job *job = job_by_pid(pid);
+  if (job == NULL)
+    return -1;
+  if (ppid) *ppid = job->ppid;
+  if (uid) *uid = 0;
+  if (gid) *gid = 0;
+  return 0;
+}
+
+/*
+ * Stand-ins for the system and LCMAPS.  Every account in the range exists,
+ * and each lock attempt is one account probed by select_account().
+ */
+struct passwd * getpwuid(uid_t uid)
+{
+  static struct passwd account;
+  static char name[32];
+
+  snprintf(name, sizeof(name), "sim%u", (unsigned)uid);
+  account.pw_name = name;
+  account.pw_uid = uid;
+  account.pw_gid = uid;
+  return &account;
+}
+
+int flock(int fd, int operation)
+{
+  probes++;
+  return syscall(SYS_flock, fd, operation);
+}
+
+// The plugin records the caller's UID as the pilot of the job.
+uid_t getuid(void)
+{
+  return (current_job < 0) ? 0 : jobs[current_job].pilot;
+}
+
+int addCredentialData(int type, void *data)
+{
+  return 0;
+}
+
+int lcmaps_cntArgs(void *args)
+{
+  return 0;
+}
+
+/*
+ * Traces.
+ */
+static struct event *events = NULL;
+static size_t nevents = 0, events_capacity = 0;
+
+static int add_event(double time, enum event_type type, int job)
+{
+  if (nevents == events_capacity) {
+    events_capacity = events_capacity ? 2*events_capacity : 1024;
+    struct event *tmp = realloc(events, events_capacity * sizeof(struct event));
+    if (tmp == NULL)
+      return -1;
+    events = tmp;
+  }
+  events[nevents].time = time;
+  events[nevents].type = type;
+  events[nevents].job = job;
+  nevents++;
+  if (job >= njobs) {
+    struct job *tmp = realloc(jobs, (job+1) * sizeof(struct job));
+    if (tmp == NULL)
+      return -1;
+    jobs = tmp;
+    memset(&jobs[njobs], 0, (job+1-njobs) * sizeof(struct job));
+    for (; njobs <= job; njobs++)
+      jobs[njobs].account = -1;
+  }
+  return 0;
+}
+
+static int load_trace(const char *path)
+{
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "Unable to open trace %s (errno=%d, %s).\n", path, errno, strerror(errno));
+    return -1;
+  }
+  char line[256], type[16];
+  double time;
+  int job, lineno = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    lineno++;
+    if ((line[0] == '#') || (line[strspn(line, " \t\n")] == '\0'))
+      continue;
+    if ((sscanf(line, "%lf %15s %d", &time, type, &job) != 3) || (job < 0)) {
+      fprintf(stderr, "%s:%d: invalid event.\n", path, lineno);
+      fclose(fp);
+      return -1;
+    }
+    enum event_type event;
+    for (event = EVENT_START; event <= EVENT_STOP; event++) {
+      if (!strcmp(type, event_names[event]))
+        break;
+    }
+    if (event > EVENT_STOP) {
+      fprintf(stderr, "%s:%d: unknown event type %s.\n", path, lineno, type);
+      fclose(fp);
+      return -1;
+    }
+    if (add_event(time, event, job)) {
+      fclose(fp);
+      return -1;
+    }
+  }
+  fclose(fp);
+  return 0;
+}
+
+static double exponential(double mean)
+{
+  return -mean * log(1.0 - drand48());
+}
+
+static int compare_events(const void *left, const void *right)
+{
+  const struct event *l = left, *r = right;
+  if (l->time != r->time)
+    return (l->time < r->time) ? -1 : 1;
+  if (l->job != r->job)
+    return l->job - r->job;
+  return (int)l->type - (int)r->type;
+}
+
+static int synthesize_trace(int count, double rate, double duration, int glexecs, double release_fraction)
+{
+  double now = 0;
+  int job, idx;
+  for (job = 0; job < count; job++) {
+    now += exponential(1.0 / rate);
+    double length = exponential(duration);
+    if (add_event(now, EVENT_START, job))
+      return -1;
+    for (idx = 0; idx < glexecs; idx++) {
+      if (add_event(now + length * drand48(), EVENT_GLEXEC, job))
+        return -1;
+    }
+    if ((drand48() < release_fraction) && add_event(now + length, EVENT_RELEASE, job))
+      return -1;
+    if (add_event(now + length, EVENT_STOP, job))
+      return -1;
+  }
+  qsort(events, nevents, sizeof(struct event), compare_events);
+  return 0;
+}
+
+static int dump_trace(const char *path)
+{
+  FILE *fp = fopen(path, "w");
+  size_t idx;
+  if (fp == NULL) {
+    fprintf(stderr, "Unable to write trace %s (errno=%d, %s).\n", path, errno, strerror(errno));
+    return -1;
+  }
+  for (idx = 0; idx < nevents; idx++)
+    fprintf(fp, "%.3f %s %d\n", events[idx].time, event_names[events[idx].type], events[idx].job);
+  fclose(fp);
+  return 0;
+}
+
+/*
+ * Replay.
+ */
+static int compare_doubles(const void *left, const void *right)
+{
+  double l = *(const double *)left, r = *(const double *)right;
+  return (l < r) ? -1 : (l > r);
+}
+
+// The selection policies read release times from the lock files, so they
+// have to follow the trace rather than the wall clock.
+static void set_lock_time(int fd, double time)
+{
+  struct timespec times[2];
+  times[0].tv_sec = (time_t)time;
+  times[0].tv_nsec = (long)((time - times[0].tv_sec) * 1e9);
+  times[1] = times[0];
+  futimens(fd, times);
+}
+
+static int release_account(int dir_fd, int uid, double time)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "sim%d", uid);
+  int fd = openat(dir_fd, name, O_RDWR);
+  if (fd == -1)
+    return -1;
+  int rc = release_lock(dir_fd, fd);
+  set_lock_time(fd, time);
+  close(fd);
+  return rc;
+}
+
+int main(int argc, char **argv)
+{
+  const char *trace = NULL, *series_path = NULL, *dump_path = NULL;
+  double probe_us = SIM_PROBE_US, verify_us = SIM_VERIFY_US, base_us = SIM_BASE_US;
+  double rate = 1, duration = 3600, release_fraction = 0;
+  int synthetic = 0, glexecs = 3, pilots = 1, min_uid = -1, max_uid = -1;
+  long seed = 1;
+  int idx;
+
+  for (idx = 1; idx < argc && strcmp(argv[idx], "--"); idx++) {
+    const char *arg = argv[idx];
+    int has_value = (idx+1 < argc);
+    if (!strcmp(arg, "-series") && has_value) series_path = argv[++idx];
+    else if (!strcmp(arg, "-dump") && has_value) dump_path = argv[++idx];
+    else if (!strcmp(arg, "-probe-us") && has_value) probe_us = atof(argv[++idx]);
+    else if (!strcmp(arg, "-verify-us") && has_value) verify_us = atof(argv[++idx]);
+    else if (!strcmp(arg, "-base-us") && has_value) base_us = atof(argv[++idx]);
+    else if (!strcmp(arg, "-pilots") && has_value) pilots = atoi(argv[++idx]);
+    else if (!strcmp(arg, "-synthetic") && has_value) synthetic = atoi(argv[++idx]);
+    else if (!strcmp(arg, "-rate") && has_value) rate = atof(argv[++idx]);
+    else if (!strcmp(arg, "-duration") && has_value) duration = atof(argv[++idx]);
+    else if (!strcmp(arg, "-glexecs") && has_value) glexecs = atoi(argv[++idx]);
+    else if (!strcmp(arg, "-release-fraction") && has_value) release_fraction = atof(argv[++idx]);
+    else if (!strcmp(arg, "-seed") && has_value) seed = atol(argv[++idx]);
+    else if (!strcmp(arg, "-v")) { tool_log_level = 5; trace_echo = 1; }
+    else if ((arg[0] != '-') && (trace == NULL)) trace = arg;
+    else break;
+  }
+  if ((idx == argc) || strcmp(argv[idx], "--") || (!trace == !synthetic) || (rate <= 0) || (pilots < 1)) {
+    fprintf(stderr, "Usage: %s [options] TRACE -- PLUGIN-OPTIONS\n"
+      "       %s [options] -synthetic JOBS -- PLUGIN-OPTIONS\n", argv[0], argv[0]);
+    return 2;
+  }
+
+  // The plugin options, with the in-memory lock directory added.
+  char lockdir[] = "/dev/shm/pool_sim.XXXXXX";
+  char fallback[] = "/tmp/pool_sim.XXXXXX";
+  char *lockpath = mkdtemp(lockdir);
+  if (lockpath == NULL)
+    lockpath = mkdtemp(fallback);
+  if (lockpath == NULL) {
+    fprintf(stderr, "Unable to create lock directory (errno=%d, %s).\n", errno, strerror(errno));
+    return 1;
+  }
+  int plugin_argc = argc - idx + 2;
+  char **plugin_argv = calloc(plugin_argc + 1, sizeof(char *));
+  if (plugin_argv == NULL)
+    return 1;
+  plugin_argv[0] = "pool_sim";
+  // Pick out the UID range the way plugin_initialize reads it.
+  for (plugin_argc = 1, idx++; idx < argc; idx++) {
+    plugin_argv[plugin_argc++] = argv[idx];
+    int *range_end = NULL;
+    if (!strncasecmp(argv[idx], "-minuid", strlen("-minuid"))) range_end = &min_uid;
+    else if (!strncasecmp(argv[idx], "-maxuid", strlen("-maxuid"))) range_end = &max_uid;
+    if (range_end && (idx+1 < argc)) {
+      *range_end = atoi(argv[++idx]);
+      plugin_argv[plugin_argc++] = argv[idx];
+    }
+  }
+  plugin_argv[plugin_argc++] = "-lockpath";
+  plugin_argv[plugin_argc++] = lockpath;
+
+  int rc = 1;
+  FILE *series = NULL;
+  int *owners = NULL;
+  uid_t *last_pilots = NULL;
+  double *latencies = NULL, *idle_times = NULL, *free_since = NULL;
+  if (plugin_initialize(plugin_argc, plugin_argv)) {
+    fprintf(stderr, "Plugin rejected its options.\n");
+    goto cleanup;
+  }
+
+  srand48(seed);
+  if (trace ? load_trace(trace) : synthesize_trace(synthetic, rate, duration, glexecs, release_fraction)) {
+    fprintf(stderr, "Unable to load the trace.\n");
+    goto cleanup;
+  }
+  if (dump_path && dump_trace(dump_path))
+    goto cleanup;
+  if (series_path && ((series = fopen(series_path, "w")) == NULL)) {
+    fprintf(stderr, "Unable to write %s (errno=%d, %s).\n", series_path, errno, strerror(errno));
+    goto cleanup;
+  }
+
+  int dir_fd = open(lockpath, O_RDONLY);
+  // As in plugin_run; on the fresh directory this only writes the marker.
+  int indexed = (dir_fd != -1) && (sweep_previous_boot(dir_fd) != -1) && get_boot_id()[0];
+  int pool_size = max_uid - min_uid + 1;
+  if ((min_uid < 0) || (pool_size < 1)) {
+    fprintf(stderr, "Unable to determine the UID range from the plugin options.\n");
+    goto cleanup;
+  }
+  owners = malloc(pool_size * sizeof(int));
+  last_pilots = malloc(pool_size * sizeof(uid_t));
+  free_since = malloc(pool_size * sizeof(double));
+  latencies = malloc(nevents * sizeof(double));
+  idle_times = malloc(nevents * sizeof(double));
+  if ((dir_fd == -1) || !owners || !last_pilots || !free_since || !latencies || !idle_times) {
+    fprintf(stderr, "Unable to set up the simulation.\n");
+    goto cleanup;
+  }
+  for (idx = 0; idx < pool_size; idx++) {
+    owners[idx] = -1;
+    last_pilots[idx] = -1;
+    free_since[idx] = -1;
+  }
+
+  size_t event_idx, allocations = 0, failures = 0, exhaustion_events = 0, conflicts = 0;
+  size_t reuses = 0, same_pilot_reuses = 0;
+  unsigned long total_probes = 0, max_probes = 0, total_verifications = 0;
+  int occupied = 0, stale = 0, peak_occupied = 0, exhausted = 0;
+  double occupied_area = 0, last_time = nevents ? events[0].time : 0;
+  for (event_idx = 0; event_idx < nevents; event_idx++) {
+    struct event *event = &events[event_idx];
+    struct job *job = &jobs[event->job];
+    occupied_area += occupied * (event->time - last_time);
+    last_time = event->time;
+
+    switch (event->type) {
+    case EVENT_START:
+      job->started = job->alive = 1;
+      job->ppid = 1000 + 2*event->job;
+      job->pid = job->ppid + 1;
+      job->starttime = (unsigned long long)(event->time * SIM_TICKS) + 1;
+      job->pilot = SIM_PILOT_UID + event->job % pilots;
+      break;
+    case EVENT_GLEXEC: {
+      if (!job->alive)
+        break;
+      const char *name = NULL;
+      struct job_identity id;
+      int uid = -1, gid = -1;
+      current_job = event->job;
+      probes = verifications = 0;
+      int fd = select_account(dir_fd, indexed, &name, &id, &uid, &gid);
+      if ((fd != -1) && (assign_account(dir_fd, fd, name, uid, &id) == -1)) {
+        close(fd);
+        fd = -1;
+      }
+      if (fd != -1)
+        set_lock_time(fd, event->time);
+      current_job = -1;
+
+      latencies[allocations++] = base_us + probes * probe_us + verifications * verify_us;
+      total_probes += probes;
+      total_verifications += verifications;
+      if (probes > max_probes)
+        max_probes = probes;
+      if (fd == -1) {
+        failures++;
+        if (!exhausted)
+          exhaustion_events++;
+        exhausted = 1;
+      } else {
+        exhausted = 0;
+        close(fd);
+        int slot = uid - min_uid;
+        if ((slot < 0) || (slot >= pool_size)) {
+          fprintf(stderr, "%.3f: account %d is outside the simulated range %d-%d.\n", event->time, uid, min_uid, max_uid);
+          goto cleanup;
+        }
+        if (owners[slot] != event->job) {
+          if ((owners[slot] != -1) && jobs[owners[slot]].alive) {
+            fprintf(stderr, "%.3f: account %d assigned to job %d while job %d still holds it.\n",
+              event->time, uid, event->job, owners[slot]);
+            conflicts++;
+            occupied--;
+          } else if (owners[slot] != -1) {
+            stale--;    // reclaimed from an exited job
+          }
+          if (free_since[slot] >= 0) {
+            idle_times[reuses++] = event->time - free_since[slot];
+            if (last_pilots[slot] == job->pilot)
+              same_pilot_reuses++;
+          }
+          owners[slot] = event->job;
+          last_pilots[slot] = job->pilot;
+          job->account = uid;
+          occupied++;
+        }
+      }
+      break;
+    }
+    case EVENT_RELEASE:
+      if ((job->account != -1) && (owners[job->account - min_uid] == event->job)) {
+        release_account(dir_fd, job->account, event->time);
+        owners[job->account - min_uid] = -1;
+        free_since[job->account - min_uid] = event->time;
+        if (job->alive) occupied--; else stale--;
+        job->account = -1;
+      }
+      break;
+    case EVENT_STOP:
+      if (!job->alive)
+        break;
+      job->alive = 0;
+      if ((job->account != -1) && (owners[job->account - min_uid] == event->job)) {
+        occupied--;
+        stale++;
+        free_since[job->account - min_uid] = event->time;
+      }
+      break;
+    }
+    if (occupied > peak_occupied)
+      peak_occupied = occupied;
+    if (series)
+      fprintf(series, "%.3f %d %d\n", event->time, occupied, stale);
+  }
+  close(dir_fd);
+
+  double span = nevents ? events[nevents-1].time - events[0].time : 0;
+  printf("pool_size %d\n", pool_size);
+  printf("events %zu\n", nevents);
+  printf("allocations %zu\n", allocations);
+  printf("failed_allocations %zu\n", failures);
+  printf("exhaustion_events %zu\n", exhaustion_events);
+  printf("conflicting_assignments %zu\n", conflicts);
+  printf("peak_occupancy %d\n", peak_occupied);
+  printf("mean_occupancy %.2f\n", span > 0 ? occupied_area / span : 0.0);
+  printf("reused_accounts %zu\n", reuses);
+  printf("same_pilot_reuses %zu\n", same_pilot_reuses);
+  if (reuses) {
+    // Time an account was free before the next job got it; short times
+    // leave little room for cleaning up after the previous job.
+    qsort(idle_times, reuses, sizeof(double), compare_doubles);
+    printf("idle_before_reuse_s_p10 %.1f\n", idle_times[reuses / 10]);
+    printf("idle_before_reuse_s_p50 %.1f\n", idle_times[reuses / 2]);
+  }
+  if (allocations) {
+    qsort(latencies, allocations, sizeof(double), compare_doubles);
+    double total_latency = 0;
+    for (event_idx = 0; event_idx < allocations; event_idx++)
+      total_latency += latencies[event_idx];
+    printf("probes_per_allocation %.2f\n", (double)total_probes / allocations);
+    printf("max_probes %lu\n", max_probes);
+    printf("verifications_per_allocation %.2f\n", (double)total_verifications / allocations);
+    printf("latency_us_mean %.1f\n", total_latency / allocations);
+    printf("latency_us_p50 %.1f\n", latencies[allocations / 2]);
+    printf("latency_us_p99 %.1f\n", latencies[(allocations * 99) / 100]);
+    printf("latency_us_max %.1f\n", latencies[allocations - 1]);
+  }
+  rc = 0;
+
+cleanup:
+  if (series)
+    fclose(series);
+  free(owners);
+  free(last_pilots);
+  free(free_since);
+  free(latencies);
+  free(idle_times);
+  plugin_terminate();
+  free(plugin_argv);
+  // Remove the lock directory, with the lock files, index and boot marker.
+  DIR *dir = opendir(lockpath);
+  struct dirent *dp;
+  while (dir && ((dp = readdir(dir)) != NULL)) {
+    if (strcmp(dp->d_name, ".") && strcmp(dp->d_name, ".."))
+      unlinkat(dirfd(dir), dp->d_name, 0);
+  }
+  if (dir)
+    closedir(dir);
+  rmdir(lockpath);
+  return rc;
+}
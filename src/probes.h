@@ -0,0 +1,37 @@
+
+#ifndef __PROBES_H
+#define __PROBES_H
+
+/*
+ * USDT static probes, provider "lcmaps_anon".  Built in only with
+ * --enable-usdt; a probe nobody is tracing is a single nop.  For example:
+ *
+ *   bpftrace -e 'usdt:/usr/lib64/lcmaps/lcmaps_anonymous_accounts.mod:lcmaps_anon:flock_result
+ *                { printf("uid %d rc %d errno %d\n", arg0, arg1, arg2); }'
+ *
+ * Probes and their arguments (the calling process is bpftrace's "pid"):
+ *   plugin_run_entry
+ *   plugin_run_return       uid, rc
+ *   select_account_entry    min_uid, max_uid
+ *   select_account_return   uid, fd
+ *   check_account_entry     uid
+ *   check_account_return    uid, rc
+ *   flock_entry             uid, fd
+ *   flock_result            uid, rc, errno
+ *   lock_write              uid, bytes, rc
+ *   mineproc_entry
+ *   mineproc_return         rc, processes
+ *   gethash_entry           pid
+ *   gethash_return          pid, rc
+ */
+
+#include "config.h"
+
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(lcmaps_anon, name, ##__VA_ARGS__)
+#else
+#define PROBE(name, ...) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * lcmaps-plugins-anonymous-accounts
+ * This code is licensed under Apache v2.0
+ */
+
+/*
+ * Stand-in for the LCMAPS logging functions, so the command-line tools
+ * can link the plugin sources without being loaded into an LCMAPS host.
+ *
+ * The LCMAPS headers are deliberately not included here: depending on the
+ * interface version, the format argument is either "char *" or
+ * "const char *", and both have the same calling convention.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "tool_log.h"
+
+int tool_log_level = 0;
+
+int lcmaps_log(int prty, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (prty > tool_log_level)
+    return 0;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  return 0;
+}
+
+int lcmaps_log_time(int prty, const char *fmt, ...)
+{
+  va_list ap;
+
+  if (prty > tool_log_level)
+    return 0;
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  return 0;
+}
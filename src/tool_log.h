@@ -0,0 +1,17 @@
+
+#ifndef __TOOL_LOG_H
+#define __TOOL_LOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Messages at or below this level are printed to stderr by the
+// tools' stand-in for lcmaps_log; defaults to 0 (errors only).
+extern int tool_log_level;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
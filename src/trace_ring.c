@@ -0,0 +1,103 @@
+/*
+ * lcmaps-plugins-anonymous-accounts
+ * This code is licensed under Apache v2.0
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#include "lcmaps/lcmaps_log.h"
+
+#include "trace_ring.h"
+
+static const char * logstr = "trace";
+
+static const char * trace_messages[TRACE_EVENT_COUNT] = {
+  [TRACE_CHECK_ACCOUNT] = "Checking validity of UID %lld.",
+  [TRACE_RECORD_FREE] = "UID %lld: no valid hash string in lock file, so we can reuse it.",
+  [TRACE_RECORD_OURS] = "UID %lld: on-disk hash matches in-memory one; using account.",
+  [TRACE_RECORD_UNVERIFIED] = "UID %lld: account is assigned to another job; not verifying it yet.",
+  [TRACE_RECORD_STALE] = "UID %lld: re-using account because on-disk hash is no longer valid.",
+  [TRACE_RECORD_LIVE] = "UID %lld: cannot re-use account - hash is still valid, and it does not match ours.",
+  [TRACE_CONSIDER_ACCOUNT] = "Considering mapping to UID %lld.",
+  [TRACE_ACCOUNT_LOCKED] = "UID %lld: not assigning account because it is in use by another process.",
+  [TRACE_ACCOUNT_IN_USE] = "UID %lld: tried account but it appears it is in use; will try another.",
+  [TRACE_FREE_ACCOUNT] = "No account assigned to this job; using free UID %lld (policy %lld).",
+  [TRACE_INDEXED_ACCOUNT] = "The index assigns UID %lld to this job; using account.",
+  [TRACE_WRITE_RECORD] = "Writing %lld:%lld:%lld to the lock file.",
+  [TRACE_INVALID_RECORD] = "Invalid hash string in lock file.",
+  [TRACE_EARLIER_BOOT] = "Lock record is from an earlier boot.",
+  [TRACE_CHECK_AGE] = "Checking age of %lld.",
+  [TRACE_BIRTHDAY_CHANGED] = "PID %lld birthday does not match lock record.",
+  [TRACE_PARENT_CHANGED] = "PID %lld: PPID %lld changed from lock record (%lld).",
+  [TRACE_COMPUTE_HASH] = "Computing ancestry hash of %lld.",
+  [TRACE_ANCESTOR] = "Considering ancestry of %lld.",
+  [TRACE_UID_TRANSITION] = "Found a UID transition from %lld to %lld.",
+  [TRACE_HASH] = "Hash %lld:%lld:%lld.",
+  [TRACE_PARENT] = "PID %lld: PPID %lld (new %lld).",
+};
+
+struct trace_entry {
+  unsigned long long when;   // ns since trace_reset
+  long long args[3];
+  enum trace_event event;
+};
+
+struct trace_ring {
+  unsigned long long start;
+  unsigned long long count;  // events recorded since trace_reset
+  struct trace_entry entries[TRACE_RING_SIZE];
+};
+
+int trace_echo = 0;
+
+static __thread struct trace_ring ring;
+
+static unsigned long long trace_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void trace_reset(void)
+{
+  ring.count = 0;
+  ring.start = trace_now();
+}
+
+static void trace_log(int level, const struct trace_entry *entry)
+{
+  char message[160];
+  snprintf(message, sizeof(message), trace_messages[entry->event], entry->args[0], entry->args[1], entry->args[2]);
+  lcmaps_log(level, "%s: +%lluus %s\n", logstr, entry->when / 1000, message);
+}
+
+void trace_event(enum trace_event event, long long a, long long b, long long c)
+{
+  struct trace_entry *entry = &ring.entries[ring.count++ % TRACE_RING_SIZE];
+  unsigned long long now = trace_now();
+  if (ring.start == 0)
+    ring.start = now;
+  entry->when = now - ring.start;
+  entry->event = event;
+  entry->args[0] = a;
+  entry->args[1] = b;
+  entry->args[2] = c;
+  if (trace_echo)
+    trace_log(5, entry);
+}
+
+void trace_dump(int level)
+{
+  unsigned long long idx = 0;
+
+  if (ring.count > TRACE_RING_SIZE) {
+    idx = ring.count - TRACE_RING_SIZE;
+    lcmaps_log(level, "%s: %llu earlier events were dropped.\n", logstr, idx);
+  }
+  for (; idx < ring.count; idx++)
+    trace_log(level, &ring.entries[idx % TRACE_RING_SIZE]);
+}
@@ -0,0 +1,62 @@
+#ifndef __TRACE_RING_H
+#define __TRACE_RING_H
+
+/*
+ * Debug trace of one plugin invocation.  Events are stored as a few
+ * integers in a fixed-size ring, without any formatting; the ring is only
+ * formatted and sent to lcmaps_log when it is dumped, e.g. after a failed
+ * mapping.  Each thread has its own ring.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The message of each event is in trace_ring.c; a, b and c are its
+// arguments, in order.
+enum trace_event {
+  TRACE_CHECK_ACCOUNT,      // uid
+  TRACE_RECORD_FREE,        // uid
+  TRACE_RECORD_OURS,        // uid
+  TRACE_RECORD_UNVERIFIED,  // uid
+  TRACE_RECORD_STALE,       // uid
+  TRACE_RECORD_LIVE,        // uid
+  TRACE_CONSIDER_ACCOUNT,   // uid
+  TRACE_ACCOUNT_LOCKED,     // uid
+  TRACE_ACCOUNT_IN_USE,     // uid
+  TRACE_FREE_ACCOUNT,       // uid, policy
+  TRACE_INDEXED_ACCOUNT,    // uid
+  TRACE_WRITE_RECORD,       // pid, ppid, starttime
+  TRACE_INVALID_RECORD,     // (none)
+  TRACE_EARLIER_BOOT,       // (none)
+  TRACE_CHECK_AGE,          // pid
+  TRACE_BIRTHDAY_CHANGED,   // pid
+  TRACE_PARENT_CHANGED,     // pid, ppid now, ppid recorded
+  TRACE_COMPUTE_HASH,       // pid
+  TRACE_ANCESTOR,           // pid
+  TRACE_UID_TRANSITION,     // ppid, pid
+  TRACE_HASH,               // pid, ppid, starttime
+  TRACE_PARENT,             // pid, old ppid, new ppid
+  TRACE_EVENT_COUNT
+};
+
+// Number of events kept; older ones are overwritten.
+#define TRACE_RING_SIZE 256
+
+// If set, every event is also logged at level 5 as it happens, as the
+// command-line tools do with -v.
+extern int trace_echo;
+
+// Start a new trace, discarding the events recorded so far.
+void trace_reset(void);
+
+void trace_event(enum trace_event event, long long a, long long b, long long c);
+
+// Log the events recorded since trace_reset, oldest first.
+void trace_dump(int level);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif